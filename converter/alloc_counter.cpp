@@ -0,0 +1,116 @@
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include <Eigen/Core>
+
+#ifdef COUNT_ALLOCATIONS
+namespace {
+    std::atomic<size_t> alloc_count(0);
+    std::atomic<size_t> alloc_bytes(0);
+    // plain thread_local counters, so that counting needs no allocation of its own
+    thread_local size_t thread_alloc_count = 0;
+    thread_local size_t thread_alloc_bytes = 0;
+
+    inline void *countedAlloc(size_t size) {
+        alloc_count.fetch_add(1, std::memory_order_relaxed);
+        alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+        ++thread_alloc_count;
+        thread_alloc_bytes += size;
+        return std::malloc(size ? size : 1);
+    }
+};
+
+void *operator new(size_t size) {
+    void *ptr = countedAlloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    void *ptr = countedAlloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return countedAlloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return countedAlloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+namespace utils {
+namespace alloc {
+    Stats current() {
+        Stats stats;
+#ifdef COUNT_ALLOCATIONS
+        stats.count = alloc_count.load(std::memory_order_relaxed);
+        stats.bytes = alloc_bytes.load(std::memory_order_relaxed);
+#endif
+        return stats;
+    }
+
+    Stats currentThread() {
+        Stats stats;
+#ifdef COUNT_ALLOCATIONS
+        stats.count = thread_alloc_count;
+        stats.bytes = thread_alloc_bytes;
+#endif
+        return stats;
+    }
+
+    void report(const std::string &label, const Stats &start) {
+        if (!enabled())
+            return;
+        Stats now = current();
+        std::cout << label << ": " << now.count - start.count << " allocations, "
+                  << now.bytes - start.bytes << " bytes" << std::endl;
+    }
+
+    NoEigenMalloc::NoEigenMalloc() {
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        Eigen::internal::set_is_malloc_allowed(false);
+#endif
+    }
+
+    NoEigenMalloc::~NoEigenMalloc() {
+        end();
+    }
+
+    void NoEigenMalloc::end() {
+        if (!_active)
+            return;
+        _active = false;
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        Eigen::internal::set_is_malloc_allowed(true);
+#endif
+    }
+};
+};
@@ -0,0 +1,47 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <cstddef>
+#include <string>
+
+// Heap allocation counting, enabled by configuring with -DCOUNT_ALLOCATIONS=ON.
+// operator new is counted; Eigen allocates with malloc, so counting builds also define
+// EIGEN_RUNTIME_NO_MALLOC and an Eigen assertion fires on any matrix allocation
+// inside an alloc::NoEigenMalloc scope.
+namespace utils {
+namespace alloc {
+    struct Stats {
+        size_t count = 0;
+        size_t bytes = 0;
+    };
+
+    inline bool enabled() {
+#ifdef COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Allocations made by the process so far, zero when counting is disabled
+    Stats current();
+    // Allocations made by the calling thread so far, to attribute them to the work of one thread
+    Stats currentThread();
+
+    // Print the allocations made since start, when counting is enabled
+    void report(const std::string &label, const Stats &start);
+
+    class NoEigenMalloc {
+    public:
+        NoEigenMalloc();
+        ~NoEigenMalloc();
+        // allow Eigen allocations again before the end of the scope
+        void end();
+    private:
+        bool _active = true;
+    };
+};
+};
+
+
+#endif //ALLOC_COUNTER_H
@@ -0,0 +1,60 @@
+#include "color_kernels.h"
+
+#include <cmath>
+
+namespace utils {
+namespace color {
+    namespace {
+        struct SRGBTable {
+            float values[256];
+
+            SRGBTable() {
+                for (int code = 0; code < 256; ++code) {
+                    const double c = code / 255.0;
+                    values[code] = (float) (c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+                }
+            }
+        };
+    };
+
+    const float* srgbToLinearTable() {
+        // initialized once, thread-safe since C++11
+        static const SRGBTable table;
+        return table.values;
+    }
+
+    void linearizeBGR8(const uint8_t *src, size_t pixels, float gain, float *dst) {
+        const float *table = srgbToLinearTable();
+#pragma omp simd
+        for (size_t i = 0; i < pixels; ++i) {
+            dst[3 * i + 0] = gain * table[src[3 * i + 2]];
+            dst[3 * i + 1] = gain * table[src[3 * i + 1]];
+            dst[3 * i + 2] = gain * table[src[3 * i + 0]];
+        }
+    }
+
+    float laplacianVariance(const uint8_t *luma, int width, int height, size_t stride) {
+        if (width < 3 || height < 3)
+            return 0.0f;
+        // per row sums stay exact in integers, the rows are accumulated in double
+        double sum = 0.0, sum_sq = 0.0;
+        for (int y = 1; y < height - 1; ++y) {
+            const uint8_t *up = luma + (y - 1) * stride;
+            const uint8_t *row = luma + y * stride;
+            const uint8_t *down = luma + (y + 1) * stride;
+            int64_t row_sum = 0, row_sum_sq = 0;
+#pragma omp simd reduction(+:row_sum, row_sum_sq)
+            for (int x = 1; x < width - 1; ++x) {
+                const int lap = up[x] + down[x] + row[x - 1] + row[x + 1] - 4 * row[x];
+                row_sum += lap;
+                row_sum_sq += lap * lap;
+            }
+            sum += row_sum;
+            sum_sq += row_sum_sq;
+        }
+        const double count = (double) (width - 2) * (height - 2);
+        const double mean = sum / count;
+        return (float) (sum_sq / count - mean * mean);
+    }
+};
+};
@@ -0,0 +1,23 @@
+#ifndef COLOR_KERNELS_H
+#define COLOR_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace utils {
+namespace color {
+    // Linear value in [0, 1] of every 8-bit sRGB code (IEC 61966-2-1), computed once on first use
+    const float* srgbToLinearTable();
+
+    // Convert a row of interleaved 8-bit BGR pixels, as OpenCV decodes them, to interleaved linear RGB floats
+    // multiplied by gain. The table lookups are gathered several pixels per instruction where the target has them.
+    void linearizeBGR8(const uint8_t *src, size_t pixels, float gain, float *dst);
+
+    // Sharpness of an 8-bit luma plane with rows stride bytes apart: the variance of its 4-neighbor Laplacian,
+    // which drops as motion blur removes the high frequencies. Comparable between frames of the same size.
+    float laplacianVariance(const uint8_t *luma, int width, int height, size_t stride);
+};
+};
+
+
+#endif //COLOR_KERNELS_H
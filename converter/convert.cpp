@@ -1,8 +1,17 @@
 #include "convert.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <vector>
 
+#include <omp.h>
+
 #include <aliceVision/mvsData/Point3d.hpp>
 #include <aliceVision/mvsData/StaticVector.hpp>
 #include <aliceVision/camera/camera.hpp>
@@ -13,13 +22,114 @@
 #include <aliceVision/mvsData/imageIO.hpp>
 #include <aliceVision/image/all.hpp>
 
+#include <OpenImageIO/imageio.h>
 #include <opencv2/opencv.hpp>
 
 #include "utils.h"
+#include "sfm_writer.h"
+#include "sfm_patch.h"
+#include "alloc_counter.h"
+#include "depth_points.h"
+#include "pipeline.h"
+#include "depth_source.h"
+#include "depth_kernels.h"
+#include "color_kernels.h"
+#include "video_source.h"
+#include "frame_cache.h"
+#include "mesh_raster.h"
+#include "tsdf_volume.h"
+#include "frame_manifest.h"
 
 namespace fs = std::experimental::filesystem;
 using namespace std;
 
+namespace {
+    std::mutex log_mutex;
+
+    // A depth frame travelling through the read, convert and write stages of assignSensorDepth.
+    // Frames are recycled by the pipeline, every buffer keeps its capacity from one view to the next.
+    struct DepthFrame {
+        int index = 0;
+        int rc = 0;
+        int depth_width = 0, depth_height = 0;
+        std::vector<float> depth;
+        std::vector<uint8_t> confidence;
+        std::vector<uint8_t> encoded; // guide image file
+        cv::Mat decoded;
+        cv::Mat guide;
+        std::vector<float> depth_map_abs;
+        std::vector<float> sim_map;
+        oiio::ParamValueList metadata;
+    };
+
+    // AliceVision depth map metadata of view rc, as written by the DepthMap node, replacing the content of metadata
+    void depthMetadata(const DepthViews &views, int rc, const utils::depth::DepthStats &stats,
+                       oiio::ParamValueList &metadata) {
+        metadata.clear();
+        for (const auto &kv : views.getMetadata(rc))
+            metadata.push_back(oiio::ParamValue(kv.first, kv.second));
+        metadata.push_back(oiio::ParamValue("AliceVision:nbDepthValues", oiio::TypeDesc::INT32, 1, &stats.valid_count));
+        metadata.push_back(oiio::ParamValue("AliceVision:downscale", views.getDownscale()));
+        metadata.push_back(oiio::ParamValue("AliceVision:CArr", oiio::TypeDesc(oiio::TypeDesc::DOUBLE, oiio::TypeDesc::VEC3), 1, views.getCenter(rc).data()));
+        metadata.push_back(oiio::ParamValue("AliceVision:iCamArr", oiio::TypeDesc(oiio::TypeDesc::DOUBLE, oiio::TypeDesc::MATRIX33), 1, views.getInverseCamera(rc).data()));
+
+        metadata.push_back(oiio::ParamValue("AliceVision:maxDepth", stats.max_depth));
+        metadata.push_back(oiio::ParamValue("AliceVision:minDepth", stats.min_depth));
+
+        std::vector<double> matrix_proj = views.getProjection44(rc);
+        metadata.push_back(oiio::ParamValue("AliceVision:P", oiio::TypeDesc(oiio::TypeDesc::DOUBLE, oiio::TypeDesc::MATRIX44), 1, matrix_proj.data()));
+    }
+
+    // Output files of the depth frame of view rc, the depth map first
+    std::vector<std::string> depthOutputs(const DepthViews &views, const std::string &folder, int rc, bool sim_map) {
+        std::vector<std::string> outputs(1, views.getDepthMapPath(folder, rc));
+        if (sim_map)
+            outputs.emplace_back(views.getSimMapPath(folder, rc));
+        return outputs;
+    }
+
+    // Settings of a depth map shared by every depth source: its size and camera
+    void hashDepthView(const DepthViews &views, int rc, FrameHash &hash) {
+        hash.add(views.getWidth(rc)).add(views.getHeight(rc));
+        for (double value : views.getProjection44(rc))
+            hash.add(value);
+    }
+
+    // EXR of interleaved channels through OIIO, stored as half or float with the given OpenEXR compression
+    void writeEXR(const std::string &path, int width, int height, const std::vector<float> &data, bool half_float,
+                  const std::string &codec, const oiio::ParamValueList &metadata, int channels = 1) {
+        // written next to the output and renamed over it, so an interrupted write never leaves a truncated frame
+        const std::string tmp_path = fs::path(path).replace_extension(".tmp" + fs::path(path).extension().string()).string();
+        std::unique_ptr<oiio::ImageOutput> out = oiio::ImageOutput::create(tmp_path);
+        if (!out)
+            throw std::runtime_error("Unable to create an image output for " + path);
+        oiio::ImageSpec spec(width, height, channels, half_float ? oiio::TypeDesc::HALF : oiio::TypeDesc::FLOAT);
+        spec.extra_attribs = metadata;
+        spec.attribute("compression", codec);
+        if (!out->open(tmp_path, spec) || !out->write_image(oiio::TypeDesc::FLOAT, data.data()) || !out->close()) {
+            const std::string error = out->geterror();
+            std::error_code ignored;
+            fs::remove(tmp_path, ignored);
+            throw std::runtime_error("Unable to write " + path + ": " + error);
+        }
+        fs::rename(tmp_path, path);
+    }
+
+    // Write the depth map of a frame, and its similarity map if computed, to folder.
+    // Similarity is always stored as half float, as the DepthMap node does.
+    void writeDepthFrame(const DepthViews &views, const std::string &folder, const DepthFrame &frame, bool half_float,
+                         const std::string &codec) {
+        // every writer opens its own OIIO output, nothing is shared between writers
+        const int rc = frame.rc;
+        writeEXR(views.getDepthMapPath(folder, rc), views.getWidth(rc), views.getHeight(rc),
+                 frame.depth_map_abs, half_float, codec, frame.metadata);
+        // the similarity map shares the metadata of its depth map, as written by the DepthMap node
+        if (!frame.sim_map.empty())
+            writeEXR(views.getSimMapPath(folder, rc), views.getWidth(rc), views.getHeight(rc),
+                     frame.sim_map, true, codec, frame.metadata);
+    }
+};
+
 Converter::Converter() {
     _linker.reset(new ObvLinker());
 }
@@ -28,29 +138,521 @@ Converter::~Converter() {
     _linker.reset();
 }
 
-void Converter::importSFM(const string &filename) {
-    if (!sfmDataIO::Load(_sfm_data, filename, sfmDataIO::ESfMData::ALL)) {
-        cerr << "The input SfMData file '" << filename << "' cannot be read.";
+ESfMData Converter::requiredParts(Stage stage) {
+    switch (stage) {
+        case Stage::ABC:
+            // poses and landmarks are rebuilt from ARKit data
+            return ESfMData(ESfMData::VIEWS | ESfMData::INTRINSICS);
+        case Stage::SFM:
+            // the imported .sfm is patched on disk, see exportSFM for the fallback
+            return ESfMData(0);
+        case Stage::DEPTH:
+            // cameras come from the trajectory, the views only name the depth maps
+            return ESfMData::VIEWS;
+        case Stage::SRGB:
+            return ESfMData::VIEWS;
+        default:
+            return ESfMData(0);
     }
 }
 
+void Converter::importSFM(const string &filename, ESfMData parts) {
+    _sfm_path = filename;
+    _sfm_parts = 0;
+    _sfm_data = sfmData::SfMData();
+    requireSfMParts(parts);
+}
+
+bool Converter::requireSfMParts(ESfMData parts) {
+    int missing = parts & ~_sfm_parts;
+    if (_sfm_path.empty() || !missing)
+        return true;
+    // observations are stored in the landmarks, reload them together
+    if (missing & (ESfMData::OBSERVATIONS | ESfMData::OBSERVATIONS_WITH_FEATURES))
+        missing |= ESfMData::STRUCTURE | (_sfm_parts & (ESfMData::OBSERVATIONS | ESfMData::OBSERVATIONS_WITH_FEATURES));
+
+    Timer<> timer;
+    const size_t peak_rss = utils::getPeakMemory();
+
+    sfmData::SfMData sfm_part;
+    sfmData::SfMData &target = _sfm_parts ? sfm_part : _sfm_data;
+    if (!sfmDataIO::Load(target, _sfm_path, ESfMData(missing))) {
+        cerr << "The input SfMData file '" << _sfm_path << "' cannot be read." << endl;
+        return false;
+    }
+
+    if (_sfm_parts) {
+        if (missing & ESfMData::VIEWS) {
+            _sfm_data.getViews().swap(sfm_part.getViews());
+            _sfm_data.getRigs().swap(sfm_part.getRigs());
+        }
+        if (missing & ESfMData::INTRINSICS)
+            _sfm_data.getIntrinsics().swap(sfm_part.getIntrinsics());
+        if (missing & ESfMData::EXTRINSICS)
+            _sfm_data.getPoses().swap(sfm_part.getPoses());
+        if (missing & ESfMData::STRUCTURE)
+            _sfm_data.getLandmarks().swap(sfm_part.getLandmarks());
+    }
+    _sfm_parts |= missing;
+
+    // all parts come from a single parse of the file, so time and memory are per load; the part sizes are
+    // estimated from the record counts
+    size_t obv_num = 0;
+    for (const auto &landmark : _sfm_data.getLandmarks())
+        obv_num += landmark.second.observations.size();
+    // the peak of the whole process, the increase is 0 when an earlier stage peaked higher
+    const size_t loaded_peak_rss = utils::getPeakMemory();
+    cout << "Loaded " << _sfm_path << " in " << timeString(timer.value()) << ", process peak RSS "
+         << memString(loaded_peak_rss) << " (+" << memString(loaded_peak_rss - peak_rss) << ")" << endl;
+    if (missing & ESfMData::VIEWS)
+        cout << "    views: " << _sfm_data.getViews().size() << endl;
+    if (missing & ESfMData::INTRINSICS)
+        cout << "    intrinsics: " << _sfm_data.getIntrinsics().size() << endl;
+    if (missing & ESfMData::EXTRINSICS)
+        cout << "    extrinsics: " << _sfm_data.getPoses().size() << endl;
+    if (missing & ESfMData::STRUCTURE)
+        cout << "    structure: " << _sfm_data.getLandmarks().size() << " landmarks, about "
+             << memString(_sfm_data.getLandmarks().size() * sizeof(sfmData::Landmark)) << endl;
+    if (missing & (ESfMData::OBSERVATIONS | ESfMData::OBSERVATIONS_WITH_FEATURES))
+        cout << "    observations: " << obv_num << ", about "
+             << memString(obv_num * sizeof(sfmData::Observations::value_type)) << endl;
+    return true;
+}
+
 void Converter::importCameras(const string &filepath, int step) {
-    _linker->importCameras(filepath, step);
+    _traj_path = filepath;
+    _sampling = FrameSampling();
+    _sampling.step = std::max(step, 1);
+    _frames_selected = false;
+    _linker->importCameras(filepath, _sampling);
+}
+
+bool Converter::selectSharpFrames() {
+    // already selected while linearizeSRGB decoded the frames
+    if (!_select_sharp_frames || _frames_selected)
+        return true;
+    if (_video_path.empty() || _traj_path.empty()) {
+        cerr << "Sharp frame selection needs the color video and the trajectory!" << endl;
+        return false;
+    }
+    VideoFrameSource video(_video_path, _sampling, true);
+    if (!video.isOpen())
+        return false;
+
+    // no color output, the frames are only decoded to be measured, in order on this thread
+    const int cam_num = _linker->getTransformArray().rows();
+    Timer<> timer;
+    cv::Mat frame;
+    int unread = 0;
+    for (int cam_idx = 0; cam_idx < cam_num; ++cam_idx) {
+        if (!video.read(cam_idx, frame))
+            ++unread;
+    }
+    cout << "Frames of " << cam_num - unread << " cameras measured in " << timeString(timer.value()) << endl;
+    if (unread)
+        cerr << "Warning: " << unread << " cameras are past the end of " << _video_path << " and keep their step-th frame" << endl;
+    this->applyFrameSelection(video);
+    return true;
+}
+
+void Converter::applyFrameSelection(const VideoFrameSource &video) {
+    const int cam_num = _linker->getTransformArray().rows();
+    vector<int> frames(cam_num);
+    int replaced = 0;
+    for (int cam_idx = 0; cam_idx < cam_num; ++cam_idx) {
+        frames[cam_idx] = video.frameIndex(cam_idx);
+        if (frames[cam_idx] != (int) _sampling.frameIndex(cam_idx))
+            ++replaced;
+    }
+    _sampling.frames = frames;
+    _linker->importCameras(_traj_path, _sampling);
+    _frames_selected = true;
+    cout << replaced << " of " << cam_num << " frames replaced by a sharper neighbor" << endl;
+
+    // the views keep their ids and names, their frame, exposure and pose follow the selection
+    const VectorXf &exposure_array = _linker->getExposureArray();
+    for (auto &view_iter : _sfm_data.getViews()) {
+        sfmData::View &view = *view_iter.second;
+        const int cam_idx = stoi(utils::io::getFileName(view.getImagePath(), false));
+        view.addMetadata("ARKit:VideoFrame", to_string(_sampling.frameIndex(cam_idx)));
+        if (cam_idx < exposure_array.size() && exposure_array(cam_idx) > 0)
+            view.addMetadata("Exif:ExposureTime", to_string(exposure_array(cam_idx)));
+    }
+    if (!_sfm_data.getViews().empty())
+        this->linkKnownPoses();
+}
+
+bool Converter::importScan(const std::string &image_folder) {
+    const bool from_video = image_folder.empty();
+    if (from_video && !utils::io::pathExists(_video_path)) {
+        cerr << "Views need the color frames or the color video!" << endl;
+        return false;
+    }
+    if (!from_video && !utils::io::pathExists(image_folder)) {
+        cerr << "Image folder " << image_folder << " doesn't exist!" << endl;
+        return false;
+    }
+    importScanMeta();
+
+    const int width = _linker->getImageWidth();
+    const int height = _linker->getImageHeight();
+    const int num_cam = _linker->getTransformArray().rows();
+    const VectorXf &exposure_array = _linker->getExposureArray();
+
+    // frames are named after their index in the sampled trajectory
+    vector<string> image_paths(num_cam);
+    if (from_video) {
+        // the frames of the video are never extracted, the views are named after the files they would be
+        // extracted to, <scanID>/<cam_idx>.png next to the video
+        const fs::path frame_folder = fs::absolute(_video_path).replace_extension("");
+        for (int cam_idx = 0; cam_idx < num_cam; ++cam_idx)
+            image_paths[cam_idx] = (frame_folder / (to_string(cam_idx) + ".png")).string();
+    }
+    else {
+        for (const auto &entry : fs::directory_iterator(image_folder)) {
+            const string stem = entry.path().stem().string();
+            if (stem.empty() || !all_of(stem.begin(), stem.end(), ::isdigit))
+                continue;
+            const int cam_idx = stoi(stem);
+            if (cam_idx < num_cam)
+                image_paths[cam_idx] = fs::absolute(entry.path()).string();
+        }
+    }
+    const string video_name = fs::path(_video_path).filename().string();
+
+    vector<std::shared_ptr<sfmData::View>> views(num_cam);
+    const IndexT intrinsic_id = 0;
+#pragma omp parallel for schedule(dynamic)
+    for (int cam_idx = 0; cam_idx < num_cam; ++cam_idx) {
+        if (image_paths[cam_idx].empty())
+            continue;
+        std::shared_ptr<sfmData::View> view = std::make_shared<sfmData::View>(
+                image_paths[cam_idx], UndefinedIndexT, intrinsic_id, UndefinedIndexT, width, height);
+        IndexT view_id;
+        if (from_video) {
+            // no image to take the metadata from, the view is identified by the step-th frame of the video,
+            // which stays its id when a sharper frame of its window is selected
+            view->addMetadata("ARKit:VideoFrame", to_string(_sampling.frameIndex(cam_idx)));
+            view_id = FrameHash().add(video_name).add((uint64_t) cam_idx * _sampling.step).value() & 0x7FFFFFFF;
+        }
+        else {
+            try {
+                for (const oiio::ParamValue &param : image::readImageMetadata(image_paths[cam_idx]))
+                    view->addMetadata(param.name().string(), param.get_string());
+            } catch (const std::exception &e) {
+#pragma omp critical
+                cerr << "Unable to read the metadata of " << image_paths[cam_idx] << ": " << e.what() << endl;
+            }
+            // the view id CameraInit would give the image, from its metadata, name and size
+            view_id = sfmDataIO::computeViewUID(*view);
+        }
+        view->setViewId(view_id);
+        view->setPoseId(view_id);
+        if (exposure_array.size() > cam_idx && exposure_array(cam_idx) > 0)
+            view->addMetadata("Exif:ExposureTime", to_string(exposure_array(cam_idx)));
+        views[cam_idx] = view;
+    }
+
+    _sfm_data = sfmData::SfMData();
+    sfmData::Views &sfm_views = _sfm_data.getViews();
+    for (auto &view : views) {
+        if (!view)
+            continue;
+        if (sfm_views.count(view->getViewId())) {
+            cerr << "Duplicate view id for " << view->getImagePath() << endl;
+            return false;
+        }
+        sfm_views[view->getViewId()] = view;
+    }
+    if (sfm_views.empty()) {
+        cerr << "No frames of the trajectory found in " << (from_video ? _video_path : image_folder) << endl;
+        return false;
+    }
+
+    const RowMatrixX9f &intrinsics_array = _linker->getIntrinsicsArray();
+    _sfm_data.getIntrinsics()[intrinsic_id] = std::make_shared<camera::PinholeRadialK3>(
+            width, height, intrinsics_array(0, 0), intrinsics_array(0, 6), intrinsics_array(0, 7));
+
+    // the scan is the only source, nothing is left to load from an sfm file
+    _sfm_path.clear();
+    _sfm_parts = ESfMData::ALL;
+    this->linkKnownPoses();
+
+    cout << sfm_views.size() << " views built from " << (from_video ? _video_path : image_folder) << endl;
+    return true;
+}
+
+bool Converter::prepareOutputFolder(const std::string &folder) {
+    return _clean_outputs ? utils::io::makeCleanFolder(folder) : utils::io::makeFolder(folder);
 }
 
 void Converter::importMesh(const string &filepath) {
+    _mesh_path = filepath;
     _linker->importMesh(filepath);
 }
 
+void Converter::subsampleVertices(float voxel_size, int max_vertices) {
+    _linker->subsampleVertices(voxel_size, max_vertices);
+}
+
+bool Converter::importScanMeta() {
+    const string meta_path = utils::io::getScanFilePath(_traj_path, ".json");
+    if (meta_path == _meta_path)
+        return _meta_imported;
+    _meta_path = meta_path;
+    _meta_imported = _linker->importMeta(meta_path);
+    if (!_meta_imported)
+        cerr << "Warning: the frames are assumed to be " << _linker->getImageWidth() << "x" << _linker->getImageHeight()
+             << " color and " << _linker->getDepthWidth() << "x" << _linker->getDepthHeight() << " depth" << endl;
+    return _meta_imported;
+}
+
+DepthViews Converter::buildDepthViews() {
+    importScanMeta();
+    return DepthViews(_sfm_data, *_linker, _depth_downscale);
+}
+
+std::unique_ptr<DepthSource> Converter::createDepthSource(const std::string &depth_path) {
+    // a stream has no header, the frame size comes from the scan meta data
+    importScanMeta();
+    std::unique_ptr<DepthSource> source = openDepthSource(depth_path, _linker->getDepthWidth(),
+                                                          _linker->getDepthHeight(), _sampling);
+    if (!source)
+        cerr << "Unable to open the depth frames of " << depth_path << endl;
+    return source;
+}
+
+std::unique_ptr<ConfidenceSource> Converter::createConfidenceSource() {
+    if (_confidence_path.empty())
+        return nullptr;
+    std::unique_ptr<ConfidenceSource> source = openConfidenceSource(_confidence_path, _linker->getDepthWidth(),
+                                                                    _linker->getDepthHeight(), _sampling);
+    if (!source)
+        cerr << "Unable to open the confidence maps of " << _confidence_path << ", depth is not masked" << endl;
+    return source;
+}
+
+bool Converter::importDepthPoints(const std::string &depth_path, float voxel_size) {
+    const RowMatrixX9f &intrinsics_array = _linker->getIntrinsicsArray();
+    const RowMatrixX16f &transform_array = _linker->getTransformArray();
+    const int num_cam = transform_array.rows();
+    if (!num_cam || voxel_size <= 0) {
+        cerr << "Depth landmarks need the camera trajectory and a voxel size!" << endl;
+        return false;
+    }
+    std::unique_ptr<DepthSource> source = createDepthSource(depth_path);
+    if (!source)
+        return false;
+    std::unique_ptr<ConfidenceSource> confidence_source = createConfidenceSource();
+    const bool sequential = source->isSequential() || (confidence_source && confidence_source->isSequential());
+    const float image_width = _linker->getImageWidth();
+
+    Timer<> timer;
+    DepthPointCloud cloud(voxel_size);
+    int frame_num = 0;
+    auto read_frame = [&](int cam_idx, int &w, int &h, std::vector<float> &depth, std::vector<uint8_t> &confidence) {
+        try {
+            int cw = 0, ch = 0;
+            if (!source->read(cam_idx, w, h, depth))
+                return false;
+            if (!confidence_source || !confidence_source->read(cam_idx, cw, ch, confidence) || cw != w || ch != h)
+                confidence.clear();
+            return true;
+        } catch (const std::exception &e) {
+#pragma omp critical
+            cerr << "Unable to read depth frame " << cam_idx << ": " << e.what() << endl;
+            return false;
+        }
+    };
+#pragma omp parallel reduction(+:frame_num)
+    {
+        // the voxel maps are sized from the team actually running the loop
+#pragma omp single
+        cloud.setThreadNum(omp_get_num_threads());
+#pragma omp for ordered schedule(dynamic)
+        for (int cam_idx = 0; cam_idx < num_cam; ++cam_idx) {
+            std::vector<float> depth;
+            std::vector<uint8_t> confidence;
+            int w = 0, h = 0;
+            bool suc;
+            // a stream is inflated in camera order, the back-projection of the frames runs in parallel
+            if (sequential) {
+#pragma omp ordered
+                suc = read_frame(cam_idx, w, h, depth, confidence);
+            }
+            else {
+                suc = read_frame(cam_idx, w, h, depth, confidence);
+            }
+            if (!suc)
+                continue;
+
+            // intrinsics of the color stream scaled to the depth resolution
+            RowMatrixX9f::ConstRowXpr intrinsics_row = intrinsics_array.row(cam_idx);
+            Eigen::Matrix3f K = Eigen::Map<const Eigen::Matrix3f>(intrinsics_row.data(), 3, 3);
+            K = K / K(2, 2);
+            K.topRows<2>() *= w / image_width;
+            RowMatrixX16f::ConstRowXpr transform_row = transform_array.row(cam_idx);
+            Eigen::Matrix4f pose = Eigen::Map<const Eigen::Matrix4f>(transform_row.data(), 4, 4);
+            pose = pose / pose(3, 3);
+
+            cloud.integrate(cam_idx, depth.data(), w, h, K, pose,
+                            confidence.empty() ? nullptr : confidence.data(), (uint8_t) _min_confidence);
+            ++frame_num;
+        }
+    }
+    if (!frame_num) {
+        cerr << "No depth frames of the trajectory found in " << depth_path << endl;
+        return false;
+    }
+
+    MatrixXf positions;
+    vector<vector<int>> cameras;
+    vector<vector<float>> scores;
+    cloud.extract(positions, cameras, scores);
+    _linker->assignPoints(std::move(positions), std::move(cameras), std::move(scores));
+
+    cout << frame_num << " depth frames back-projected to " << _linker->getVertNum()
+         << " landmarks (took " << timeString(timer.value()) << ")" << endl;
+    return true;
+}
+
+bool Converter::fuseDepth(const std::string &depth_path, const std::string &mesh_path, float voxel_size, size_t budget_bytes) {
+    const RowMatrixX9f &intrinsics_array = _linker->getIntrinsicsArray();
+    const RowMatrixX16f &transform_array = _linker->getTransformArray();
+    const int num_cam = transform_array.rows();
+    if (!num_cam || voxel_size <= 0) {
+        cerr << "Depth fusion needs the camera trajectory and a voxel size!" << endl;
+        return false;
+    }
+    std::unique_ptr<DepthSource> source = createDepthSource(depth_path);
+    if (!source)
+        return false;
+    std::unique_ptr<ConfidenceSource> confidence_source = createConfidenceSource();
+    const float image_width = _linker->getImageWidth();
+
+    // frames are fused one after the other in camera order, each of them in parallel
+    Timer<> timer;
+    TSDFVolume volume(voxel_size, 4.0f, budget_bytes);
+    std::vector<float> depth;
+    std::vector<uint8_t> confidence;
+    int frame_num = 0;
+    for (int cam_idx = 0; cam_idx < num_cam; ++cam_idx) {
+        int w = 0, h = 0, cw = 0, ch = 0;
+        try {
+            if (!source->read(cam_idx, w, h, depth))
+                continue;
+            if (!confidence_source || !confidence_source->read(cam_idx, cw, ch, confidence) || cw != w || ch != h)
+                confidence.clear();
+        } catch (const std::exception &e) {
+            cerr << "Unable to read depth frame " << cam_idx << ": " << e.what() << endl;
+            continue;
+        }
+
+        // intrinsics of the color stream scaled to the depth resolution
+        RowMatrixX9f::ConstRowXpr intrinsics_row = intrinsics_array.row(cam_idx);
+        Eigen::Matrix3f K = Eigen::Map<const Eigen::Matrix3f>(intrinsics_row.data(), 3, 3);
+        K = K / K(2, 2);
+        K.topRows<2>() *= w / image_width;
+        RowMatrixX16f::ConstRowXpr transform_row = transform_array.row(cam_idx);
+        Eigen::Matrix4f pose = Eigen::Map<const Eigen::Matrix4f>(transform_row.data(), 4, 4);
+        pose = pose / pose(3, 3);
+
+        volume.integrate(depth.data(), w, h, K, pose,
+                         confidence.empty() ? nullptr : confidence.data(), (uint8_t) _min_confidence);
+        ++frame_num;
+    }
+    if (!frame_num) {
+        cerr << "No depth frames of the trajectory found in " << depth_path << endl;
+        return false;
+    }
+    cout << frame_num << " depth frames fused into " << volume.getBlockNum() << " blocks of voxel size " << voxel_size
+         << " (" << memString(volume.getMemory()) << ") in " << timeString(timer.value()) << endl;
+    if (volume.getDroppedBlockNum())
+        cout << volume.getDroppedBlockNum() << " blocks beyond the memory budget of " << memString(budget_bytes)
+             << " were not allocated" << endl;
+
+    timer.reset();
+    MatrixXu faces;
+    MatrixXf positions;
+    volume.extractMesh(faces, positions);
+    cout << "Extracted " << faces.cols() << " faces and " << positions.cols() << " vertices in "
+         << timeString(timer.value()) << endl;
+    write_mesh(mesh_path, faces, positions);
+    return true;
+}
+
+void Converter::enableColorSampling(size_t cache_bytes, int downscale) {
+    _image_cache.reset(new ImageCache(cache_bytes, downscale));
+}
+
+void Converter::sampleObservations(const vector<vector<int>> &visibility, vector<size_t> &offsets,
+                                   MatrixXu8 &colors, VectorXf &luminance) {
+    const int num_points = visibility.size();
+    const int num_cam = _linker->getTransformArray().rows();
+
+    // invert the visibility into the observations of every camera
+    offsets.assign(num_points + 1, 0);
+    vector<size_t> cam_offsets(num_cam + 1, 0);
+    for (int p = 0; p < num_points; ++p) {
+        offsets[p + 1] = offsets[p] + visibility[p].size();
+        for (int cam : visibility[p])
+            ++cam_offsets[cam + 1];
+    }
+    std::partial_sum(cam_offsets.begin(), cam_offsets.end(), cam_offsets.begin());
+    vector<size_t> cam_observations(offsets[num_points]);
+    vector<size_t> cam_fill(cam_offsets.begin(), cam_offsets.end() - 1);
+    for (int p = 0; p < num_points; ++p) {
+        for (size_t j = 0; j < visibility[p].size(); ++j)
+            cam_observations[cam_fill[visibility[p][j]]++] = offsets[p] + j;
+    }
+    vector<int> observation_points(offsets[num_points]);
+    for (int p = 0; p < num_points; ++p)
+        std::fill(observation_points.begin() + offsets[p], observation_points.begin() + offsets[p + 1], p);
+
+    colors = MatrixXu8::Zero(3, offsets[num_points]);
+    luminance = VectorXf::Constant(offsets[num_points], NAN);
+
+    const MatrixXf &positions = _linker->getPositions();
+    const float image_width = _linker->getImageWidth();
+    const vector<IndexT> views_id = getViewIdsByCamera();
+    Timer<> timer;
+#pragma omp parallel for schedule(dynamic)
+    for (int cam = 0; cam < num_cam; ++cam) {
+        if (cam_offsets[cam] == cam_offsets[cam + 1] || cam >= (int) views_id.size())
+            continue;
+        std::shared_ptr<const cv::Mat> image = _image_cache->get(_sfm_data.getView(views_id[cam]).getImagePath());
+        if (!image)
+            continue;
+        // the projection gives full resolution pixels, frames may be downscaled
+        const float scale = image->cols / image_width;
+        const Eigen::Matrix<float, 3, 4> project = _linker->getProjection(cam);
+        for (size_t o = cam_offsets[cam]; o < cam_offsets[cam + 1]; ++o) {
+            const size_t obv = cam_observations[o];
+            Eigen::Vector3f pixel = project.leftCols<3>() * positions.col(observation_points[obv]) + project.col(3);
+            const int x = std::min(std::max((int) (pixel(0) / pixel(2) * scale), 0), image->cols - 1);
+            const int y = std::min(std::max((int) (pixel(1) / pixel(2) * scale), 0), image->rows - 1);
+            const cv::Vec3b &bgr = image->at<cv::Vec3b>(y, x);
+            colors.col(obv) << bgr[2], bgr[1], bgr[0];
+            luminance(obv) = 0.2126f * bgr[2] + 0.7152f * bgr[1] + 0.0722f * bgr[0];
+        }
+    }
+    cout << offsets[num_points] << " observations sampled in " << timeString(timer.value()) << endl;
+    _image_cache->printStats();
+}
+
 void Converter::linkKnownPoses() {
     sfmData::Views &views = _sfm_data.getViews();
+    if (views.empty()) {
+        cerr << "No views to link the known poses to" << endl;
+        return;
+    }
 
     vector<string> empty;
     _sfm_data.setFeaturesFolders(empty);
     _sfm_data.setMatchesFolders(empty);
 
-    auto transform_array = _linker->getTransformArray();
-    auto intrinsics_array = _linker->getIntrinsicsArray();
+    const RowMatrixX16f &transform_array = _linker->getTransformArray();
+    const RowMatrixX9f &intrinsics_array = _linker->getIntrinsicsArray();
 
     vector<IndexT> views_id(views.size());
     for (auto &view_iter : views) {
@@ -89,23 +691,44 @@ vector<size_t> sort_indexes(const vector<T> &v) {
   return idx;
 }
 
-void Converter::buildABC() {
-    _linker->linkVertices(_sfm_data);
-
+vector<IndexT> Converter::getViewIdsByCamera() {
     sfmData::Views &views = _sfm_data.getViews();
-
-    int vert_num = _linker->getVertNum();
-    auto positions = _linker->getPositions();
-    auto intrinsics_array = _linker->getIntrinsicsArray();
-    auto transform_array = _linker->getTransformArray();
-    auto visibility = _linker->getAssociatedCameras();
-    auto points_score = _linker->getAssociatedScores();
-
     vector<IndexT> views_id(views.size());
     for (auto &view_iter : views) {
         int cam_idx = stoi(utils::io::getFileName(view_iter.second->getImagePath(), false));
         views_id[cam_idx] = view_iter.second->getViewId();
     }
+    return views_id;
+}
+
+void Converter::selectLandmarkViews() {
+    requireSfMParts(requiredParts(Stage::ABC));
+    // back-projected depth points come with the views they were seen from
+    if (!_linker->hasVisibility())
+        _linker->linkVertices(_sfm_data);
+
+    sfmData::Views &views = _sfm_data.getViews();
+
+    // borrow the camera arrays and take over the visibility, nothing is copied
+    const utils::alloc::Stats handoff_start = utils::alloc::current();
+    utils::alloc::NoEigenMalloc no_matrix_copy;
+    const MatrixXf &positions = _linker->getPositions();
+    const RowMatrixX9f &intrinsics_array = _linker->getIntrinsicsArray();
+    const RowMatrixX16f &transform_array = _linker->getTransformArray();
+    vector<vector<int>> visibility = _linker->releaseAssociatedCameras();
+    vector<vector<float>> points_score = _linker->releaseAssociatedScores();
+    no_matrix_copy.end();
+    utils::alloc::report("Linker handoff", handoff_start);
+
+    vector<IndexT> views_id = getViewIdsByCamera();
+
+    vector<size_t> obv_offsets;
+    MatrixXu8 obv_colors;
+    VectorXf obv_luminance;
+    if (_image_cache)
+        sampleObservations(visibility, obv_offsets, obv_colors, obv_luminance);
+    const bool sampled = !obv_offsets.empty();
+    _landmark_colors = MatrixXu8::Constant(3, positions.cols(), 255);
 
     auto isclose = [](float a, float b, float tol) { return fabs(a-b) < tol; };
     auto lum_diff = [](float a, float b) { return fabs(a-b); };
@@ -117,12 +740,21 @@ void Converter::buildABC() {
         auto & cameras = visibility[p];
         auto & score_array = points_score[p];
 
+        // vote on luminance when the frames are sampled, otherwise on the distance to the image center
+        vector<float> luminance_array;
+        if (sampled) {
+            luminance_array.assign(obv_luminance.data() + obv_offsets[p], obv_luminance.data() + obv_offsets[p+1]);
+            if (std::none_of(luminance_array.begin(), luminance_array.end(), [](float v) { return !std::isnan(v); }))
+                luminance_array.clear();
+        }
+        const vector<float> &vote_array = luminance_array.empty() ? score_array : luminance_array;
+
         int max_count = 0;
         int index = -1;
-        for (int i=0; i<score_array.size(); ++i) {
+        for (int i=0; i<vote_array.size(); ++i) {
             int count = 0;
-            for (int j=0; j<score_array.size(); ++j) {
-                if (isclose(score_array[i], score_array[j], tol))
+            for (int j=0; j<vote_array.size(); ++j) {
+                if (isclose(vote_array[i], vote_array[j], tol))
                     count++;
             }
 
@@ -137,18 +769,30 @@ void Converter::buildABC() {
             continue;
         }
 
-        float majority = score_array[index];
+        float majority = vote_array[index];
         vector<float> diffs(cameras.size());
         for (int idx = 0; idx < cameras.size(); ++idx) {
-            // diffs[idx] = lum_diff(luminance_array[idx], majority);
-            diffs[idx] = fabs(score_array[idx]);
+            if (luminance_array.empty())
+                diffs[idx] = fabs(score_array[idx]);
+            else if (std::isnan(luminance_array[idx]))
+                diffs[idx] = std::numeric_limits<float>::infinity();
+            else
+                diffs[idx] = lum_diff(luminance_array[idx], majority);
         }
         vector<size_t> best_idx = sort_indexes<float>(diffs);
         int k = 15;
         vector<int> top_k;
+        Eigen::Vector3f color = Eigen::Vector3f::Zero();
+        int color_count = 0;
         for (int i=0; i<k && i<best_idx.size(); i++) {
             top_k.emplace_back(cameras[best_idx[i]]);
+            if (!luminance_array.empty() && !std::isnan(luminance_array[best_idx[i]])) {
+                color += obv_colors.col(obv_offsets[p] + best_idx[i]).cast<float>();
+                ++color_count;
+            }
         }
+        if (color_count)
+            _landmark_colors.col(p) = (color / color_count).array().round().cast<uint8_t>();
         cameras = top_k;
         cout << visibility[p].size() << " visible camera in point " << p << endl;
     }
@@ -158,12 +802,9 @@ void Converter::buildABC() {
         if (visibility[i].size() < 1)
             continue;
         // float value = float(visibility[i].size())/15.0*255.0;
-        float value = 255.0;
-        colormap.col(i)(0) = value;
-        colormap.col(i)(1) = value;
-        colormap.col(i)(2) = value;
+        colormap.col(i) = _landmark_colors.col(i).cast<float>();
     }
-    _linker->assignColorMap(colormap);
+    _linker->assignColorMap(std::move(colormap));
 
     cout << zero_viz_count << " points have no visibility" << endl;
     cout << "Number of cameras: " << views.size() << endl;
@@ -186,12 +827,24 @@ void Converter::buildABC() {
         _sfm_data.setPose(*view_iter.second, cam_pose);
     }
 
+    _landmark_cameras = std::move(visibility);
+}
+
+void Converter::buildABC() {
+    this->selectLandmarkViews();
+
+    int vert_num = _linker->getVertNum();
+    const MatrixXf &positions = _linker->getPositions();
+    const vector<vector<int>> &visibility = _landmark_cameras;
+    vector<IndexT> views_id = getViewIdsByCamera();
+
     _sfm_data.getLandmarks().clear();
 
     const double unknownScale = 0.0;
     for (std::size_t i = 0; i < vert_num; ++i) {
         const Vec3 &point = positions.col(i).cast<double>();
         sfmData::Landmark landmark(point, feature::EImageDescriberType::UNKNOWN);
+        landmark.rgb = image::RGBColor(_landmark_colors(0, i), _landmark_colors(1, i), _landmark_colors(2, i));
         // set landmark observations from ptsCams if any
         if (!visibility[i].empty()) {
             for (int cam : visibility[i]) {
@@ -209,13 +862,89 @@ void Converter::buildABC() {
     this->removeLandmarksWithoutObservations();
 }
 
+bool Converter::streamSFM(const std::string &filepath) {
+    this->selectLandmarkViews();
+
+    const int vert_num = _linker->getVertNum();
+    const MatrixXf &positions = _linker->getPositions();
+    const vector<IndexT> views_id = getViewIdsByCamera();
+
+    SfMStreamWriter writer(filepath);
+    if (!writer.writeHeader(_sfm_data))
+        return false;
+
+    // landmarks are formatted in parallel chunks of vertices and written in vertex order
+    const int chunk_size = 4096;
+    const int chunk_num = 4 * omp_get_max_threads();
+    vector<string> chunks(chunk_num);
+    size_t landmark_count = 0;
+    bool suc = true;
+    for (int start = 0; start < vert_num && suc; start += chunk_size * chunk_num) {
+#pragma omp parallel for schedule(dynamic) reduction(+:landmark_count)
+        for (int c = 0; c < chunk_num; ++c) {
+            string &chunk = chunks[c];
+            chunk.clear();
+            vector<pair<IndexT, Vec2>> observations;
+            const int end = std::min(start + (c + 1) * chunk_size, vert_num);
+            for (int i = start + c * chunk_size; i < end; ++i) {
+                if (_landmark_cameras[i].empty())
+                    continue;
+                const Vec3 point = positions.col(i).cast<double>();
+                observations.clear();
+                for (int cam : _landmark_cameras[i]) {
+                    const sfmData::View &view = _sfm_data.getView(views_id[cam]);
+                    const camera::IntrinsicBase *intrinsicPtr = _sfm_data.getIntrinsicPtr(view.getIntrinsicId());
+                    observations.emplace_back(view.getViewId(),
+                            intrinsicPtr->project(_sfm_data.getPose(view).getTransform(), point, true));
+                }
+                std::sort(observations.begin(), observations.end(),
+                          [](const pair<IndexT, Vec2> &a, const pair<IndexT, Vec2> &b) { return a.first < b.first; });
+                const image::RGBColor color(_landmark_colors(0, i), _landmark_colors(1, i), _landmark_colors(2, i));
+                writer.formatLandmark(chunk, i, point, color, observations);
+                ++landmark_count;
+            }
+        }
+        for (int c = 0; c < chunk_num && suc; ++c)
+            suc = writer.writeChunk(chunks[c]);
+    }
+
+    suc = writer.close() && suc;
+    cout << landmark_count << " landmarks streamed to " << filepath << endl;
+    return suc;
+}
+
 void Converter::exportSFM(const std::string &filepath) {
+    if (utils::io::checkExtension(_sfm_path, ".sfm") && utils::io::checkExtension(filepath, ".sfm")) {
+        long t1 = clock();
+        if (patchKnownPoses(_sfm_path, filepath, _linker->getIntrinsicsArray(), _linker->getTransformArray())) {
+            cout << "Patched known poses into " << filepath << " in " << mvsUtils::formatElapsedTime(t1) << endl;
+            // keep the in-memory sfm data consistent for the following stages, the depth and sRGB stages only
+            // load the views but the poses are linked with the updated intrinsic
+            if (!_sfm_data.getViews().empty() && requireSfMParts(ESfMData::INTRINSICS))
+                this->linkKnownPoses();
+            return;
+        }
+        cout << "Unable to patch " << _sfm_path << ", serializing the full sfm data instead" << endl;
+    }
+
+    requireSfMParts(ESfMData::ALL);
     this->linkKnownPoses();
     if (utils::io::checkExtension(filepath, ".sfm"))
         sfmDataIO::Save(_sfm_data, filepath, sfmDataIO::ESfMData::ALL_DENSE);
 }
 
 void Converter::exportABC(const string &filepath) {
+    // landmarks are observed from the views, without any there is nothing to write
+    if (!requireSfMParts(requiredParts(Stage::ABC)) || _sfm_data.getViews().empty()) {
+        cerr << "Landmarks need the views of an sfm file or of the scan, " << filepath << " is not written" << endl;
+        return;
+    }
+    if (utils::io::checkExtension(filepath, ".sfm")) {
+        if (!this->streamSFM(filepath))
+            cerr << "Unable to stream landmarks to " << filepath << endl;
+        return;
+    }
+
     this->buildABC();
     if (utils::io::checkExtension(filepath, ".abc"))
         sfmDataIO::Save(_sfm_data, filepath, sfmDataIO::ESfMData::ALL_DENSE);
@@ -238,81 +967,681 @@ void Converter::removeLandmarksWithoutObservations() {
     }
 }
 
-bool Converter::assignSensorDepth(const std::string& srgb_folder, const std::string& depth_folder, const std::string& output_folder) {
-    mvsUtils::MultiViewParams mp(_sfm_data, srgb_folder, output_folder, "", false);
+bool Converter::assignSensorDepth(const std::string& depth_path, const std::string& output_folder) {
+    if (!requireSfMParts(requiredParts(Stage::DEPTH)))
+        return false;
+    // cameras and sizes from the trajectory and the scan meta data, no image is opened before the first frame
+    const DepthViews views = buildDepthViews();
+    const int num_views = views.size();
 
-    if (!utils::io::makeCleanFolder(output_folder) || !utils::io::pathExists(srgb_folder) || !utils::io::pathExists(depth_folder))
+    if (!prepareOutputFolder(output_folder))
         return false;
+    std::unique_ptr<DepthSource> source = createDepthSource(depth_path);
+    if (!source)
+        return false;
+    std::unique_ptr<ConfidenceSource> confidence_source = createConfidenceSource();
+    const bool guided = _depth_upsampling == DepthUpsampling::GUIDED;
+
+    // frames in camera order, which a depth stream is inflated in
+    vector<int> order(num_views);
+    iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return views.getCamIndex(a) < views.getCamIndex(b); });
+
+    // frames written by a previous run from the same inputs and settings are kept
+    FrameManifest manifest(output_folder);
+    vector<uint64_t> hashes(num_views);
+    for (int rc = 0; rc < num_views; ++rc) {
+        FrameHash hash;
+        hash.add(string("sensor")).add((int) _depth_upsampling).add(_min_confidence).add(_write_sim_maps).add(4.0f)
+            .add(_depth_half).add(_exr_codec);
+        hashDepthView(views, rc, hash);
+        source->hashFrame(views.getCamIndex(rc), hash);
+        if (confidence_source)
+            confidence_source->hashFrame(views.getCamIndex(rc), hash);
+        if (guided)
+            hash.addFile(views.getImagePath(rc));
+        hashes[rc] = hash.value();
+    }
+    order.erase(std::remove_if(order.begin(), order.end(), [&](int rc) {
+        const vector<string> outputs = depthOutputs(views, output_folder, rc, _write_sim_maps);
+        return manifest.isCurrent(fs::path(outputs[0]).filename().string(), hashes[rc], outputs);
+    }), order.end());
+    const int frame_num = order.size();
+    if (frame_num < num_views)
+        cout << num_views - frame_num << " depth maps are up to date" << endl;
+
+    // disk reads, depth processing and EXR encoding of different frames overlap in a three-stage
+    // pipeline; OIIO would otherwise spawn its own thread pool inside each worker
+    const int workers = _num_threads > 0 ? _num_threads : omp_get_max_threads();
+    const int io_threads = std::max(_io_threads, 1);
+    const int read_threads = source->isSequential() || (confidence_source && confidence_source->isSequential()) ? 1 : io_threads;
+    int oiio_threads = 0, exr_threads = 0;
+    oiio::getattribute("threads", oiio_threads);
+    oiio::getattribute("exr_threads", exr_threads);
+    oiio::attribute("threads", 1);
+    oiio::attribute("exr_threads", 1);
 
-    long t1 = clock();
-// #pragma omp parallel for
-    for(int rc = 0; rc < mp.ncams; rc++) {
-        const int width = mp.getWidth(rc);
-        const int height = mp.getHeight(rc);
-
-        string depth_idx = utils::io::getFileName(_sfm_data.getView(mp.getViewId(rc)).getImagePath(), false);
-
-        std::vector<float> depth_map;
-        int w, h;
-        fs::path abs_dir = fs::absolute(depth_folder);
-        imageIO::readImage(abs_dir.string()+"/"+depth_idx+".exr", w, h, depth_map, imageIO::EImageColorSpace::NO_CONVERSION);
-        cv::Mat depth_mat(h, w, CV_32FC1, depth_map.data());
-        depth_mat.setTo(NAN, depth_mat == 0);
-        depth_mat.setTo(NAN, depth_mat > 4.0);
-        if (width != w || height != h) {
-            cv::resize(depth_mat, depth_mat, cv::Size(width, height), 0, 0);
+    // log a failed stage of a frame instead of aborting the conversion
+    auto guard = [](const char *stage, int rc, const std::function<bool()> &run) {
+        try {
+            return run();
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            cerr << "Unable to " << stage << " depth frame of camera " << rc << ": " << e.what() << endl;
+            return false;
         }
+    };
 
-        double min_depth, max_depth;
-        cv::minMaxLoc(depth_mat, &min_depth, &max_depth);
-        cv::patchNaNs(depth_mat, -1);
-        std::vector<float> depth_map_abs(depth_mat.begin<float>(), depth_mat.end<float>());
-        const int nb_depth_values = std::count_if(depth_map_abs.begin(), depth_map_abs.end(), [](float v) { return v > 0.0f; });
-
-        oiio::ParamValueList metadata = imageIO::getMetadataFromMap(mp.getMetadata(rc));
-        metadata.push_back(oiio::ParamValue("AliceVision:nbDepthValues", oiio::TypeDesc::INT32, 1, &nb_depth_values));
-        metadata.push_back(oiio::ParamValue("AliceVision:downscale", mp.getDownscaleFactor(rc)));
-        metadata.push_back(oiio::ParamValue("AliceVision:CArr", oiio::TypeDesc(oiio::TypeDesc::DOUBLE, oiio::TypeDesc::VEC3), 1, mp.CArr[rc].m));
-        metadata.push_back(oiio::ParamValue("AliceVision:iCamArr", oiio::TypeDesc(oiio::TypeDesc::DOUBLE, oiio::TypeDesc::MATRIX33), 1, mp.iCamArr[rc].m));
-        
-        
-        metadata.push_back(oiio::ParamValue("AliceVision:maxDepth", (float)max_depth));
-        metadata.push_back(oiio::ParamValue("AliceVision:minDepth", (float)min_depth));
-        
-        std::vector<double> matrix_proj = mp.getOriginalP(rc);
-        metadata.push_back(oiio::ParamValue("AliceVision:P", oiio::TypeDesc(oiio::TypeDesc::DOUBLE, oiio::TypeDesc::MATRIX44), 1, matrix_proj.data()));
-        
-        using namespace imageIO;
-        OutputFileColorSpace colorspace(EImageColorSpace::NO_CONVERSION);
-        writeImage(getFileNameFromIndex(&mp, rc, mvsUtils::EFileType::depthMap, 1), width, height, depth_map_abs, EImageQuality::LOSSLESS,  colorspace, metadata);
+    // frames are sized for the largest view once, and reused by the following views
+    size_t max_pixels = 0;
+    for (int rc : order)
+        max_pixels = std::max(max_pixels, (size_t) views.getWidth(rc) * views.getHeight(rc));
+    Timer<> timer;
+    utils::pipeline::FramePipeline<DepthFrame> pipeline(2 * workers);
+    pipeline.setFrameInit([&](DepthFrame &frame) {
+        frame.depth_map_abs.reserve(max_pixels);
+        if (_write_sim_maps)
+            frame.sim_map.reserve(max_pixels);
+    });
+    const size_t written = pipeline.run(frame_num,
+        [&](int idx, DepthFrame &frame) {
+            frame.rc = order[idx];
+            return guard("read", frame.rc, [&]() {
+                const int cam_idx = views.getCamIndex(frame.rc);
+                if (source->read(cam_idx, frame.depth_width, frame.depth_height, frame.depth)) {
+                    int w = 0, h = 0;
+                    if (confidence_source && (!confidence_source->read(cam_idx, w, h, frame.confidence) ||
+                                              w != frame.depth_width || h != frame.depth_height)) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        cerr << "Confidence map " << cam_idx << " missing, depth frame is not masked" << endl;
+                        frame.confidence.clear();
+                    }
+                    if (guided) {
+                        const string &image_path = views.getImagePath(frame.rc);
+                        // decoded into the buffers of the frame rather than a new image per view
+                        if (!utils::io::readFile(image_path, frame.encoded) ||
+                            (cv::imdecode(frame.encoded, cv::IMREAD_GRAYSCALE, &frame.decoded), frame.decoded.empty())) {
+                            std::lock_guard<std::mutex> lock(log_mutex);
+                            cerr << "Unable to read the guide " << image_path << ", depth is upsampled bilinearly" << endl;
+                            frame.guide.release();
+                        }
+                        else if (frame.decoded.cols != views.getWidth(frame.rc) || frame.decoded.rows != views.getHeight(frame.rc)) {
+                            cv::resize(frame.decoded, frame.guide, cv::Size(views.getWidth(frame.rc), views.getHeight(frame.rc)), 0, 0, cv::INTER_AREA);
+                        }
+                        else {
+                            frame.decoded.copyTo(frame.guide);
+                        }
+                    }
+                    return true;
+                }
+                std::lock_guard<std::mutex> lock(log_mutex);
+                cerr << "Depth frame " << cam_idx << " not found in " << depth_path << endl;
+                return false;
+            });
+        }, read_threads,
+        [&](int, DepthFrame &frame) {
+            const int rc = frame.rc;
+            return guard("convert", rc, [&]() {
+                const int width = views.getWidth(rc);
+                const int height = views.getHeight(rc);
+                // range and confidence masking, resampling and statistics in one pass, straight into
+                // the buffer handed to the EXR writer; low confidence pixels never reach the depth maps
+                frame.depth_map_abs.resize(width * height);
+                const uint8_t *confidence = frame.confidence.empty() ? nullptr : frame.confidence.data();
+                const utils::depth::DepthStats stats = frame.guide.empty() ?
+                        utils::depth::resampleDepth(frame.depth.data(), frame.depth_width, frame.depth_height,
+                                                    confidence, (uint8_t) _min_confidence, 4.0f,
+                                                    frame.depth_map_abs.data(), width, height) :
+                        utils::depth::upsampleDepthGuided(frame.depth.data(), frame.depth_width, frame.depth_height,
+                                                          confidence, (uint8_t) _min_confidence, 4.0f,
+                                                          frame.guide.ptr<uint8_t>(), frame.depth_map_abs.data(), width, height);
+                if (_write_sim_maps) {
+                    frame.sim_map.resize(width * height);
+                    utils::depth::computeSimMap(frame.depth_map_abs.data(), width, height, confidence,
+                                                frame.depth_width, frame.depth_height, frame.sim_map.data());
+                }
+                depthMetadata(views, rc, stats, frame.metadata);
+                return true;
+            });
+        }, workers,
+        [&](int, DepthFrame &frame) {
+            const int rc = frame.rc;
+            return guard("write", rc, [&]() {
+                writeDepthFrame(views, output_folder, frame, _depth_half, _exr_codec);
+                const vector<string> outputs = depthOutputs(views, output_folder, rc, _write_sim_maps);
+                manifest.record(fs::path(outputs[0]).filename().string(), hashes[rc], outputs);
+                return true;
+            });
+        }, io_threads);
+
+    oiio::attribute("threads", oiio_threads);
+    oiio::attribute("exr_threads", exr_threads);
+    manifest.save();
+    cout << written << " depth maps written with " << io_threads << " I/O threads and " << workers
+         << " workers in " << timeString(timer.value()) << endl;
+    pipeline.printStats();
+
+    return written == (size_t) frame_num;
+}
+
+bool Converter::renderMeshDepth(const std::string& output_folder) {
+    if (!requireSfMParts(requiredParts(Stage::DEPTH)))
+        return false;
+    if (!_linker->getFaces().cols()) {
+        cerr << "No mesh faces to render depth from, import the mesh before subsampling it" << endl;
+        return false;
     }
-    cout << mvsUtils::formatElapsedTime(t1) << endl;
+    const DepthViews views = buildDepthViews();
+    const int num_views = views.size();
+    if (!prepareOutputFolder(output_folder))
+        return false;
 
-    return true;
+    // frames rendered by a previous run from the same mesh and settings are kept
+    FrameManifest manifest(output_folder);
+    vector<uint64_t> hashes(num_views);
+    vector<int> order;
+    for (int rc = 0; rc < num_views; ++rc) {
+        FrameHash hash;
+        hash.add(string("mesh")).add(_write_sim_maps).add(4.0f).add(_depth_half).add(_exr_codec).addFile(_mesh_path);
+        hashDepthView(views, rc, hash);
+        hashes[rc] = hash.value();
+        const vector<string> outputs = depthOutputs(views, output_folder, rc, _write_sim_maps);
+        if (!manifest.isCurrent(fs::path(outputs[0]).filename().string(), hashes[rc], outputs))
+            order.emplace_back(rc);
+    }
+    const int frame_num = order.size();
+    if (frame_num < num_views)
+        cout << num_views - frame_num << " depth maps are up to date" << endl;
+
+    // views render in parallel, and the tiles of a view are shared by the cores left to each view
+    const int workers = _num_threads > 0 ? _num_threads : omp_get_max_threads();
+    const int tile_threads = std::max(omp_get_max_threads() / workers, 1);
+    const int io_threads = std::max(_io_threads, 1);
+    const float image_width = _linker->getImageWidth();
+    int oiio_threads = 0, exr_threads = 0;
+    oiio::getattribute("threads", oiio_threads);
+    oiio::getattribute("exr_threads", exr_threads);
+    oiio::attribute("threads", 1);
+    oiio::attribute("exr_threads", 1);
+
+    auto guard = [](const char *stage, int rc, const std::function<bool()> &run) {
+        try {
+            return run();
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            cerr << "Unable to " << stage << " mesh depth of camera " << rc << ": " << e.what() << endl;
+            return false;
+        }
+    };
+
+    const MeshRasterizer rasterizer(_linker->getPositions(), _linker->getFaces());
+    Timer<> timer;
+    utils::pipeline::FramePipeline<DepthFrame> pipeline(2 * workers);
+    const size_t written = pipeline.run(frame_num,
+        [&](int idx, DepthFrame &frame) {
+            frame.rc = order[idx];
+            return true;
+        }, 1,
+        [&](int, DepthFrame &frame) {
+            const int rc = frame.rc;
+            return guard("render", rc, [&]() {
+                const int width = views.getWidth(rc);
+                const int height = views.getHeight(rc);
+                // projection of the color stream scaled to the depth map resolution
+                Eigen::Matrix<float, 3, 4> projection = views.getProjection(rc).cast<float>();
+                projection.topRows<2>() *= width / image_width;
+
+                frame.depth_map_abs.resize(width * height);
+                const utils::depth::DepthStats stats = rasterizer.render(projection, width, height, 4.0f,
+                                                                         frame.depth_map_abs.data(), tile_threads);
+                // rendered depth has no confidence, every valid pixel gets the best similarity
+                if (_write_sim_maps) {
+                    frame.sim_map.resize(width * height);
+                    utils::depth::computeSimMap(frame.depth_map_abs.data(), width, height, nullptr, 0, 0, frame.sim_map.data());
+                }
+                depthMetadata(views, rc, stats, frame.metadata);
+                return true;
+            });
+        }, workers,
+        [&](int, DepthFrame &frame) {
+            return guard("write", frame.rc, [&]() {
+                writeDepthFrame(views, output_folder, frame, _depth_half, _exr_codec);
+                const vector<string> outputs = depthOutputs(views, output_folder, frame.rc, _write_sim_maps);
+                manifest.record(fs::path(outputs[0]).filename().string(), hashes[frame.rc], outputs);
+                return true;
+            });
+        }, io_threads);
+
+    oiio::attribute("threads", oiio_threads);
+    oiio::attribute("exr_threads", exr_threads);
+    manifest.save();
+    cout << written << " depth maps rendered from " << _linker->getFaces().cols() << " faces with " << workers
+         << " workers in " << timeString(timer.value()) << endl;
+    pipeline.printStats();
+
+    return written == (size_t) frame_num;
 }
 
+namespace {
+    // neighbor depth maps are compared at a quarter of their resolution
+    struct LowDepthMap {
+        std::vector<float> depth;
+        int width = 0, height = 0;
+        int full_width = 0;
+    };
+};
+
+bool Converter::filterDepthMaps(const std::string& depth_folder, const std::string& output_folder,
+                                int neighbor_num, int min_consistent, float rel_tolerance) {
+    if (!requireSfMParts(requiredParts(Stage::DEPTH)))
+        return false;
+    if (!utils::io::pathExists(depth_folder) || !prepareOutputFolder(output_folder))
+        return false;
+    const DepthViews depth_views = buildDepthViews();
+    const int num_views = depth_views.size();
+
+    const RowMatrixX9f &intrinsics_array = _linker->getIntrinsicsArray();
+    const RowMatrixX16f &transform_array = _linker->getTransformArray();
+    const float image_width = _linker->getImageWidth();
+
+    // intrinsics at a depth map width, and camera poses of the views
+    vector<int> cam_indices(num_views);
+    vector<Eigen::Matrix4f> poses(num_views);
+    for (int rc = 0; rc < num_views; ++rc) {
+        cam_indices[rc] = depth_views.getCamIndex(rc);
+        RowMatrixX16f::ConstRowXpr transform_row = transform_array.row(cam_indices[rc]);
+        poses[rc] = Eigen::Map<const Eigen::Matrix4f>(transform_row.data(), 4, 4);
+        poses[rc] /= poses[rc](3, 3);
+    }
+    auto intrinsics = [&](int rc, int width) {
+        RowMatrixX9f::ConstRowXpr intrinsics_row = intrinsics_array.row(cam_indices[rc]);
+        Eigen::Matrix3f K = Eigen::Map<const Eigen::Matrix3f>(intrinsics_row.data(), 3, 3);
+        K /= K(2, 2);
+        K.topRows<2>() *= width / image_width;
+        return K;
+    };
+
+    // the k closest cameras looking in a similar direction
+    vector<vector<int>> neighbors(num_views);
+#pragma omp parallel for schedule(static)
+    for (int rc = 0; rc < num_views; ++rc) {
+        vector<pair<float, int>> candidates;
+        for (int tc = 0; tc < num_views; ++tc) {
+            if (tc == rc || poses[rc].block<3, 1>(0, 2).dot(poses[tc].block<3, 1>(0, 2)) < 0.5f)
+                continue;
+            candidates.emplace_back((poses[rc].block<3, 1>(0, 3) - poses[tc].block<3, 1>(0, 3)).squaredNorm(), tc);
+        }
+        const int k = std::min<int>(neighbor_num, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+        for (int i = 0; i < k; ++i)
+            neighbors[rc].emplace_back(candidates[i].second);
+    }
+
+    // downsampled neighbor depth shared by the views, each map is read once while its neighborhood is filtered
+    const int low_scale = 4;
+    FrameCache<int, LowDepthMap> neighbor_cache((size_t) 512 << 20,
+        [&](int tc) {
+            std::vector<float> depth;
+            int w = 0, h = 0;
+            imageIO::readImage(depth_views.getDepthMapPath(depth_folder, tc), w, h, depth,
+                               imageIO::EImageColorSpace::NO_CONVERSION);
+            std::shared_ptr<LowDepthMap> low = std::make_shared<LowDepthMap>();
+            low->full_width = w;
+            low->width = w / low_scale;
+            low->height = h / low_scale;
+            low->depth.resize((size_t) low->width * low->height);
+            for (int y = 0; y < low->height; ++y)
+                for (int x = 0; x < low->width; ++x)
+                    low->depth[(size_t) y * low->width + x] = depth[(size_t) (y * low_scale + low_scale / 2) * w + x * low_scale + low_scale / 2];
+            return std::shared_ptr<const LowDepthMap>(low);
+        },
+        [](const LowDepthMap &low) { return low.depth.size() * sizeof(float); });
+
+    // views filtered by a previous run from the same depth maps and settings are kept
+    FrameManifest manifest(output_folder);
+    vector<uint64_t> hashes(num_views);
+    vector<int> order;
+    for (int rc = 0; rc < num_views; ++rc) {
+        FrameHash hash;
+        hash.add(string("filter")).add(neighbor_num).add(min_consistent).add(rel_tolerance).add(_depth_half)
+            .add(_exr_codec);
+        hashDepthView(depth_views, rc, hash);
+        hash.addFile(depth_views.getDepthMapPath(depth_folder, rc));
+        for (int tc : neighbors[rc])
+            hash.addFile(depth_views.getDepthMapPath(depth_folder, tc));
+        hashes[rc] = hash.value();
+        const vector<string> outputs = depthOutputs(depth_views, output_folder, rc, true);
+        if (!manifest.isCurrent(fs::path(outputs[0]).filename().string(), hashes[rc], outputs))
+            order.emplace_back(rc);
+    }
+    // in camera order, so that the views filtered at the same time share most of their neighbors in the cache
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return cam_indices[a] < cam_indices[b]; });
+    const int frame_num = order.size();
+    if (frame_num < num_views)
+        cout << num_views - frame_num << " filtered depth maps are up to date" << endl;
+
+    // views are filtered in parallel; OIIO would otherwise spawn its own thread pool inside each worker
+    int oiio_threads = 0, exr_threads = 0;
+    oiio::getattribute("threads", oiio_threads);
+    oiio::getattribute("exr_threads", exr_threads);
+    oiio::attribute("threads", 1);
+    oiio::attribute("exr_threads", 1);
+
+    Timer<> timer;
+    size_t kept = 0, total = 0;
+    int failed = 0, isolated = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:kept, total, failed, isolated)
+    for (int i = 0; i < frame_num; ++i) {
+        const int rc = order[i];
+        try {
+            const string depth_path = depth_views.getDepthMapPath(depth_folder, rc);
+            std::vector<float> depth;
+            int width = 0, height = 0;
+            imageIO::readImage(depth_path, width, height, depth, imageIO::EImageColorSpace::NO_CONVERSION);
+
+            const int num_neighbors = neighbors[rc].size();
+            vector<std::shared_ptr<const LowDepthMap>> neighbor_maps(num_neighbors);
+            for (int n = 0; n < num_neighbors; ++n)
+                neighbor_maps[n] = neighbor_cache.get(neighbors[rc][n]);
+
+            utils::depth::DepthView ref;
+            ref.depth = depth.data();
+            ref.width = width;
+            ref.height = height;
+            ref.K = intrinsics(rc, width);
+            ref.pose = poses[rc];
+            vector<utils::depth::DepthView> views;
+            for (int n = 0; n < num_neighbors; ++n) {
+                if (!neighbor_maps[n] || neighbor_maps[n]->depth.empty())
+                    continue;
+                utils::depth::DepthView view;
+                view.depth = neighbor_maps[n]->depth.data();
+                view.width = neighbor_maps[n]->width;
+                view.height = neighbor_maps[n]->height;
+                view.K = intrinsics(neighbors[rc][n], neighbor_maps[n]->width);
+                view.pose = poses[neighbors[rc][n]];
+                views.emplace_back(view);
+            }
+
+            // a view without enough readable neighbors has no depth to confirm, it is written empty
+            if ((int) views.size() < std::max(min_consistent, 1))
+                ++isolated;
+
+            std::vector<float> depth_filtered(depth.size()), sim_map(depth.size());
+            utils::depth::DepthStats stats = utils::depth::filterConsistentDepth(ref, views, 0, height, min_consistent,
+                                                                                 rel_tolerance, depth_filtered.data(),
+                                                                                 sim_map.data());
+            kept += stats.valid_count;
+            total += std::count_if(depth.begin(), depth.end(), [](float v) { return v > 0.0f; });
+
+            // the camera metadata of the input is kept, the depth statistics are updated
+            oiio::ParamValueList metadata = image::readImageMetadata(depth_path);
+            metadata.remove("AliceVision:nbDepthValues");
+            metadata.remove("AliceVision:minDepth");
+            metadata.remove("AliceVision:maxDepth");
+            metadata.push_back(oiio::ParamValue("AliceVision:nbDepthValues", oiio::TypeDesc::INT32, 1, &stats.valid_count));
+            metadata.push_back(oiio::ParamValue("AliceVision:minDepth", stats.min_depth));
+            metadata.push_back(oiio::ParamValue("AliceVision:maxDepth", stats.max_depth));
+
+            writeEXR(depth_views.getDepthMapPath(output_folder, rc), width, height, depth_filtered,
+                     _depth_half, _exr_codec, metadata);
+            writeEXR(depth_views.getSimMapPath(output_folder, rc), width, height, sim_map,
+                     true, _exr_codec, metadata);
+            const vector<string> outputs = depthOutputs(depth_views, output_folder, rc, true);
+            manifest.record(fs::path(outputs[0]).filename().string(), hashes[rc], outputs);
+        } catch (const std::exception &e) {
+            cerr << "Unable to filter the depth map of camera " << rc << ": " << e.what() << endl;
+            ++failed;
+        }
+    }
+
+    cout << "Kept " << kept << " of " << total << " depth values consistent with " << neighbor_num
+         << " neighbor views in " << timeString(timer.value()) << endl;
+    if (isolated)
+        cerr << isolated << " views have fewer than " << min_consistent << " neighbor views, all their depth is rejected" << endl;
+    neighbor_cache.printStats("Neighbor depth cache");
+    oiio::attribute("threads", oiio_threads);
+    oiio::attribute("exr_threads", exr_threads);
+    return manifest.save() && failed == 0;
+}
+
+namespace {
+    // A color frame travelling through the read, linearize and write stages of linearizeSRGB
+    struct ColorFrame {
+        int index = 0;
+        int view = 0;
+        cv::Mat srgb; // 8-bit BGR
+        size_t video_frame = 0;
+        float exposure = 1.0f;
+        bool current = false; // up to date in the output, found once the sharpest frame is selected
+        image::Image<image::RGBfColor> image; // frames deeper than 8 bits, linearized when read
+        std::vector<float> linear;
+        int width = 0, height = 0;
+        oiio::ParamValueList metadata;
+    };
+};
+
 bool Converter::linearizeSRGB(const std::string& srgb_folder, const std::string& output_folder) {
-    if (!utils::io::makeCleanFolder(output_folder) || !utils::io::pathExists(srgb_folder))
+    if (!requireSfMParts(requiredParts(Stage::SRGB)))
+        return false;
+    // the sharpest frames are selected while the video is decoded, unless an earlier stage selected them
+    const bool select_sharp = !_video_path.empty() && _select_sharp_frames && !_frames_selected;
+    std::unique_ptr<VideoFrameSource> video;
+    if (!_video_path.empty()) {
+        video.reset(new VideoFrameSource(_video_path, _sampling, select_sharp));
+        if (!video->isOpen())
+            return false;
+    }
+    if (!prepareOutputFolder(output_folder) || (!video && !utils::io::pathExists(srgb_folder)))
         return false;
 
-    const float median_camera_exposure = _sfm_data.getMedianCameraExposureSetting();
-    sfmData::Views &views = _sfm_data.getViews();
-    for (auto &view_iter : views) {
-        image::Image<image::RGBfColor> image;
-        string src_img = view_iter.second->getImagePath();
-        readImage(src_img, image, image::EImageColorSpace::LINEAR);
+    // exposure durations of the trajectory in seconds, or the relative exposure settings of the views when the
+    // trajectory has none; the two are never mixed
+    const VectorXf &exposure_array = _linker->getExposureArray();
+    const bool trajectory_exposures = exposure_array.size() && (exposure_array.array() > 0.0f).any();
+    vector<const sfmData::View *> views;
+    vector<int> cam_indices;
+    vector<float> exposures;
+    for (const auto &view_iter : _sfm_data.getViews()) {
+        const sfmData::View &view = *view_iter.second;
+        const string stem = fs::path(view.getImagePath()).stem().string();
+        const int cam_idx = !stem.empty() && all_of(stem.begin(), stem.end(), ::isdigit) ? stoi(stem) : -1;
+        // frames of the video are found by their index in the sampled trajectory
+        if (video && cam_idx < 0) {
+            cerr << "View " << view.getImagePath() << " is not a frame of the trajectory, it is not in the video" << endl;
+            continue;
+        }
+        float exposure = -1.0f;
+        if (!trajectory_exposures)
+            exposure = view.getCameraExposureSetting();
+        else if (cam_idx >= 0 && cam_idx < exposure_array.size())
+            exposure = exposure_array(cam_idx);
+        views.emplace_back(&view);
+        cam_indices.emplace_back(cam_idx);
+        exposures.emplace_back(exposure);
+    }
 
-        float camera_exposure = view_iter.second->getCameraExposureSetting();
-        float ev = std::log2(1.0 / camera_exposure);
-        float exposureCompensation = median_camera_exposure / camera_exposure;
-        oiio::ParamValueList metadata = image::readImageMetadata(src_img);
-        metadata.push_back(oiio::ParamValue("AliceVision:EV", ev));
-        metadata.push_back(oiio::ParamValue("AliceVision:EVComp", exposureCompensation));
+    // views without an exposure are dropped, unless no view has one and all are written uncompensated
+    const size_t known = std::count_if(exposures.begin(), exposures.end(), [](float e) { return e > 0.0f; });
+    if (!known) {
+        cerr << "No exposure in the trajectory or the views, the images are written without exposure compensation" << endl;
+        std::fill(exposures.begin(), exposures.end(), 1.0f);
+    }
+    else if (known < views.size()) {
+        cerr << views.size() - known << " views have no " << (trajectory_exposures ? "trajectory" : "view")
+             << " exposure, no image is written for them" << endl;
+        size_t kept = 0;
+        for (size_t v = 0; v < views.size(); ++v) {
+            if (!(exposures[v] > 0.0f))
+                continue;
+            views[kept] = views[v];
+            cam_indices[kept] = cam_indices[v];
+            exposures[kept] = exposures[v];
+            ++kept;
+        }
+        views.resize(kept);
+        cam_indices.resize(kept);
+        exposures.resize(kept);
+    }
+    vector<float> sorted_exposures(exposures);
+    std::nth_element(sorted_exposures.begin(), sorted_exposures.begin() + sorted_exposures.size() / 2, sorted_exposures.end());
+    const float median_camera_exposure = sorted_exposures.empty() ? 1.0f : sorted_exposures[sorted_exposures.size() / 2];
 
-        fs::path abs_dir = fs::absolute(output_folder);
-        writeImage(abs_dir.string()+"/"+ to_string(view_iter.second->getViewId())+".exr", image, image::EImageColorSpace::AUTO, metadata);
+    // a selected frame takes the trajectory exposure of its own frame, the median stays the one of the step-th frames
+    VectorXf frame_exposures;
+    if (select_sharp && trajectory_exposures)
+        frame_exposures = _linker->importFrameExposures(_traj_path);
+    auto selectedExposure = [&](int v, size_t frame_idx) {
+        return frame_idx < (size_t) frame_exposures.size() && frame_exposures(frame_idx) > 0.0f
+               ? frame_exposures(frame_idx) : exposures[v];
+    };
+
+    // images converted by a previous run from the same frames and exposures are kept
+    FrameManifest manifest(output_folder);
+    vector<int> pending;
+    vector<uint64_t> hashes(views.size());
+    auto outputName = [&](int v) { return to_string(views[v]->getViewId()) + ".exr"; };
+    auto outputPath = [&](int v) { return (fs::absolute(output_folder) / outputName(v)).string(); };
+    auto hashView = [&](int v, float exposure) {
+        FrameHash hash;
+        if (video)
+            video->hashFrame(cam_indices[v], hash);
+        else
+            hash.addFile(views[v]->getImagePath());
+        hash.add(exposure).add(median_camera_exposure).add(_exr_codec);
+        return hash.value();
+    };
+    for (size_t v = 0; v < views.size(); ++v) {
+        // every frame is decoded to be selected, its hash is only known then
+        if (select_sharp) {
+            pending.emplace_back(v);
+            continue;
+        }
+        hashes[v] = hashView(v, exposures[v]);
+        if (!manifest.isCurrent(outputName(v), hashes[v], vector<string>(1, outputPath(v))))
+            pending.emplace_back(v);
     }
+    if (pending.size() < views.size())
+        cout << views.size() - pending.size() << " sRGB images are up to date" << endl;
+    // the video is decoded forward, in camera order
+    if (video)
+        std::sort(pending.begin(), pending.end(), [&](int a, int b) { return cam_indices[a] < cam_indices[b]; });
 
-    return true;
+    // decoding, linearization and EXR encoding of different frames overlap in a three-stage pipeline;
+    // OIIO would otherwise spawn its own thread pool inside each writer
+    const int workers = _num_threads > 0 ? _num_threads : omp_get_max_threads();
+    const int io_threads = std::max(_io_threads, 1);
+    int oiio_threads = 0, exr_threads = 0;
+    oiio::getattribute("threads", oiio_threads);
+    oiio::getattribute("exr_threads", exr_threads);
+    oiio::attribute("threads", 1);
+    oiio::attribute("exr_threads", 1);
+
+    auto guard = [&](const char *stage, int v, const std::function<bool()> &run) {
+        try {
+            return run();
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            cerr << "Unable to " << stage << " " << views[v]->getImagePath() << ": " << e.what() << endl;
+            return false;
+        }
+    };
+
+    Timer<> timer;
+    std::atomic<size_t> up_to_date(0);
+    utils::pipeline::FramePipeline<ColorFrame> pipeline(2 * workers);
+    const size_t written = pipeline.run(pending.size(),
+        [&](int idx, ColorFrame &frame) {
+            frame.view = pending[idx];
+            frame.exposure = exposures[frame.view];
+            frame.current = false;
+            return guard("read", frame.view, [&]() {
+                // frames of the video are decoded straight to memory, no image file is written in between
+                if (video) {
+                    const int cam_idx = cam_indices[frame.view];
+                    if (!video->read(cam_idx, frame.srgb))
+                        throw std::runtime_error("frame " + to_string(cam_idx) + " not decoded from " + _video_path);
+                    frame.video_frame = video->frameIndex(cam_idx);
+                    if (select_sharp) {
+                        frame.exposure = selectedExposure(frame.view, frame.video_frame);
+                        hashes[frame.view] = hashView(frame.view, frame.exposure);
+                        frame.current = manifest.isCurrent(outputName(frame.view), hashes[frame.view],
+                                                           vector<string>(1, outputPath(frame.view)));
+                    }
+                    return true;
+                }
+                const string &src_img = views[frame.view]->getImagePath();
+                frame.srgb = cv::imread(src_img, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH | cv::IMREAD_IGNORE_ORIENTATION);
+                if (frame.srgb.empty() || frame.srgb.depth() != CV_8U) {
+                    // deeper frames are linearized by AliceVision
+                    frame.srgb.release();
+                    readImage(src_img, frame.image, image::EImageColorSpace::LINEAR);
+                }
+                return true;
+            });
+        }, video ? 1 : io_threads,
+        [&](int, ColorFrame &frame) {
+            return guard("linearize", frame.view, [&]() {
+                if (frame.current)
+                    return true;
+                if (!frame.srgb.empty()) {
+                    // 8-bit frames go through the lookup table, pixels stay uncompensated as EVComp is stored
+                    frame.width = frame.srgb.cols;
+                    frame.height = frame.srgb.rows;
+                    frame.linear.resize((size_t) frame.width * frame.height * 3);
+                    for (int y = 0; y < frame.height; ++y)
+                        utils::color::linearizeBGR8(frame.srgb.ptr<uint8_t>(y), frame.width, 1.0f,
+                                                    frame.linear.data() + (size_t) y * frame.width * 3);
+                }
+                else {
+                    frame.width = frame.image.Width();
+                    frame.height = frame.image.Height();
+                    const float *pixels = reinterpret_cast<const float *>(frame.image.data());
+                    frame.linear.assign(pixels, pixels + (size_t) frame.width * frame.height * 3);
+                }
+
+                // the metadata imported with the views, the image is not opened a second time
+                const float camera_exposure = frame.exposure;
+                frame.metadata.clear();
+                for (const auto &kv : views[frame.view]->getMetadata())
+                    frame.metadata.push_back(oiio::ParamValue(kv.first, kv.second));
+                if (select_sharp) {
+                    // the views were built from the step-th frames
+                    frame.metadata.remove("ARKit:VideoFrame");
+                    frame.metadata.push_back(oiio::ParamValue("ARKit:VideoFrame", to_string(frame.video_frame)));
+                    if (trajectory_exposures) {
+                        frame.metadata.remove("Exif:ExposureTime");
+                        frame.metadata.push_back(oiio::ParamValue("Exif:ExposureTime", to_string(camera_exposure)));
+                    }
+                }
+                frame.metadata.push_back(oiio::ParamValue("AliceVision:EV", std::log2(1.0f / camera_exposure)));
+                frame.metadata.push_back(oiio::ParamValue("AliceVision:EVComp", median_camera_exposure / camera_exposure));
+                return true;
+            });
+        }, workers,
+        [&](int, ColorFrame &frame) {
+            return guard("write", frame.view, [&]() {
+                if (frame.current) {
+                    ++up_to_date;
+                    return true;
+                }
+                const string output = outputPath(frame.view);
+                writeEXR(output, frame.width, frame.height, frame.linear, false, _exr_codec, frame.metadata, 3);
+                manifest.record(outputName(frame.view), hashes[frame.view], vector<string>(1, output));
+                return true;
+            });
+        }, io_threads);
+
+    oiio::attribute("threads", oiio_threads);
+    oiio::attribute("exr_threads", exr_threads);
+    cout << written - up_to_date << " sRGB images linearized " << (video ? "from " + _video_path + " " : string())
+         << "in " << timeString(timer.value()) << endl;
+    if (up_to_date)
+        cout << up_to_date << " sRGB images of the selected frames are up to date" << endl;
+    pipeline.printStats();
+    // the cameras of the following stages are the frames just selected, the step-th ones where no frame was read
+    if (select_sharp)
+        this->applyFrameSelection(*video);
+    return manifest.save() && written == pending.size();
 }
 
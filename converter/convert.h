@@ -14,40 +14,166 @@
 #include <aliceVision/sfmDataIO/AlembicExporter.hpp>
 
 #include "obv_linker.h"
+#include "image_cache.h"
+#include "depth_source.h"
+#include "depth_views.h"
+
+class VideoFrameSource;
 
 using namespace aliceVision;
 using namespace aliceVision::sfmDataIO;
 
-class ObvLinker;
-class Converter: public ObvLinker {
+class Converter {
 public:
     explicit Converter();
     ~Converter();
 
-    void importSFM(const std::string& filename);
-
-    void importCameras(const std::string& filepath, int step=2) override;
-    void importMesh(const std::string& filepath) override;
-
-    // Assign camera poses from ARKit to Meshroom .sfm file
+    // Stages reading the imported .sfm, each declares the SfMData parts it needs
+    enum class Stage { ABC, SFM, DEPTH, SRGB, MESH };
+    static ESfMData requiredParts(Stage stage);
+
+    // Load the given parts of the .sfm, missing parts are loaded lazily by the stages needing them
+    void importSFM(const std::string& filename, ESfMData parts = ESfMData::ALL);
+
+    // Import every step-th camera of the trajectory; selectSharpFrames or linearizeSRGB may replace them by
+    // sharper frames later
+    void importCameras(const std::string& filepath, int step=2);
+    // Build known-pose sfm data from the imported trajectory, <scanID>.json and the color frames,
+    // in place of a cameras.sfm from a first Meshroom iteration. Without an image folder, the views are the
+    // frames of the color video set by setColorVideo, and no frame has to be extracted
+    bool importScan(const std::string& image_folder);
+    void importMesh(const std::string& filepath);
+    void subsampleVertices(float voxel_size, int max_vertices);
+    // ARKit confidence maps, a folder of <cam_idx>.png or the .confidence.zlib stream, masking depth
+    // below min_confidence in every stage reading sensor depth
+    inline void setConfidence(const std::string& confidence_path, int min_confidence) {
+        _confidence_path = confidence_path;
+        _min_confidence = min_confidence;
+    }
+    // Build landmarks from the sensor depth frames back-projected with the known poses, one per voxel,
+    // in place of an imported mesh
+    bool importDepthPoints(const std::string& depth_path, float voxel_size);
+
+    // Fuse the sensor depth frames with the known poses into a sparse TSDF volume of voxel_size, allocated
+    // up to budget_bytes, and write the extracted surface to a PLY/OBJ mesh
+    bool fuseDepth(const std::string& depth_path, const std::string& mesh_path, float voxel_size, size_t budget_bytes);
+
+    // Sample landmark colors from the color frames, decoded once through a cache of cache_bytes,
+    // and pick the observing views by luminance agreement instead of the distance to the image center
+    void enableColorSampling(size_t cache_bytes, int downscale = 1);
+
+    // Assign camera poses from ARKit to Meshroom .sfm file, patching the imported .sfm
+    // in place of re-serializing it when possible
     void exportSFM(const std::string& filepath);
 
+    // Export landmarks to an alembic file, or stream them to a dense .sfm file
     void exportABC(const std::string& filepath);
-    void exportMesh(const std::string& filepath) override;
-
-    // Convert ARKit depth to Meshroom depth maps
-    bool assignSensorDepth(const std::string& srgb_folder, const std::string& depth_folder, const std::string& output_folder);
+    void exportMesh(const std::string& filepath);
+
+    // Number of worker threads of the parallel stages, 0 to use all cores
+    inline void setThreads(int num_threads) { _num_threads = num_threads; }
+    // Number of threads reading and, separately, writing frames in the I/O bound stages
+    inline void setIOThreads(int io_threads) { _io_threads = io_threads; }
+
+    // Wipe the output folders of the per-frame stages instead of regenerating only their stale frames
+    inline void setCleanOutputs(bool clean_outputs) { _clean_outputs = clean_outputs; }
+
+    // Upsampling of the sensor depth to the color resolution in assignSensorDepth, GUIDED follows
+    // the edges of the color frame with a joint bilateral filter
+    enum class DepthUpsampling { BILINEAR, GUIDED };
+    inline void setDepthUpsampling(DepthUpsampling upsampling) { _depth_upsampling = upsampling; }
+
+    // Written depth maps at the color resolution divided by downscale, as Meshroom's DepthMap node does,
+    // stored as half or full float with the given OpenEXR compression
+    inline void setDepthOutput(int downscale, bool half_float, const std::string& exr_codec) {
+        _depth_downscale = std::max(downscale, 1);
+        _depth_half = half_float;
+        _exr_codec = exr_codec;
+    }
+
+    // Also write Meshroom simMap files next to the depth maps, derived from the ARKit confidence
+    inline void setWriteSimMaps(bool write_sim_maps) { _write_sim_maps = write_sim_maps; }
+
+    // Convert ARKit depth, decoded .exr frames or the .depth.zlib stream, to Meshroom depth maps
+    bool assignSensorDepth(const std::string& depth_path, const std::string& output_folder);
+    // Render full resolution depth maps of the imported mesh seen from the known poses, written like
+    // assignSensorDepth; the mesh must not be subsampled to landmarks yet
+    bool renderMeshDepth(const std::string& output_folder);
+    // Keep the depth of every view that its k nearest views, by the known poses, see consistently and write
+    // filtered depth and sim maps in the layout of Meshroom's DepthMapFilter
+    bool filterDepthMaps(const std::string& depth_folder, const std::string& output_folder,
+                         int neighbor_num = 5, int min_consistent = 2, float rel_tolerance = 0.03f);
+    // Decode the color frames of linearizeSRGB from the ARKit <scanID>.mp4 instead of reading the view images
+    inline void setColorVideo(const std::string& video_path) { _video_path = video_path; }
+    // Replace blurry frames of the color video by the sharpest frame of their step window, measured while the
+    // video is decoded by linearizeSRGB or selectSharpFrames. The selection becomes the cameras of the following
+    // stages: poses, depth and confidence streams and the frames of the views built from the video. Image and
+    // frame folders keep the step-th frames.
+    inline void setSharpFrameSelection(bool select_sharp_frames) { _select_sharp_frames = select_sharp_frames; }
+    // Decode the video to select the sharp frames, if set and not already selected by linearizeSRGB
+    bool selectSharpFrames();
+    // Write every view as a linear EXR with its exposure metadata, in the layout of Meshroom's PrepareDenseScene
     bool linearizeSRGB(const std::string& srgb_folder, const std::string& output_folder);
 
 protected:
+    // Load the parts of the imported .sfm that are not loaded yet
+    bool requireSfMParts(ESfMData parts);
+
     // Assign camera poses to sfm
     void linkKnownPoses();
+    // Pick the observing cameras of every landmark and assign the ARKit poses
+    void selectLandmarkViews();
     void buildABC();
+    // Write the .sfm with landmarks formatted straight from the selected views
+    bool streamSFM(const std::string& filepath);
     void removeLandmarksWithoutObservations();
+    // Sample the color and luminance of every observation of the landmarks, in parallel over cameras.
+    // Observations of landmark p are stored from offsets[p] to offsets[p+1], unreadable ones get NaN luminance.
+    void sampleObservations(const std::vector<std::vector<int>>& visibility, std::vector<size_t>& offsets,
+                            MatrixXu8& colors, VectorXf& luminance);
 
 private:
+    std::vector<IndexT> getViewIdsByCamera();
+    // Take the frames selected while the video was read as the cameras, and move the views onto them
+    void applyFrameSelection(const VideoFrameSource& video);
+    // Color and depth stream resolutions from <scanID>.json next to the trajectory, imported once; without it the
+    // default ARKit resolutions are kept and a warning is printed
+    bool importScanMeta();
+    // Cameras of the depth maps of the views, from the trajectory rather than the images
+    DepthViews buildDepthViews();
+    // Depth frames of a folder of <cam_idx>.exr files or of a <scanID>.depth.zlib stream
+    std::unique_ptr<DepthSource> createDepthSource(const std::string& depth_path);
+    // Confidence maps set by setConfidence, empty if none
+    std::unique_ptr<ConfidenceSource> createConfidenceSource();
+    // Output folder of a per-frame stage, emptied first if clean outputs are set
+    bool prepareOutputFolder(const std::string& folder);
+
+    // the converter owns the only copy of the ARKit camera and mesh data
     std::unique_ptr<ObvLinker> _linker;
+    std::string _sfm_path;
+    std::string _traj_path;
+    std::string _meta_path;
+    bool _meta_imported = false;
+    FrameSampling _sampling;
+    std::string _confidence_path;
+    int _min_confidence = 1;
+    DepthUpsampling _depth_upsampling = DepthUpsampling::BILINEAR;
+    bool _write_sim_maps = false;
+    bool _clean_outputs = false;
+    int _depth_downscale = 1;
+    bool _depth_half = false;
+    std::string _exr_codec = "piz";
+    std::string _mesh_path;
+    std::string _video_path;
+    bool _select_sharp_frames = false;
+    bool _frames_selected = false;
+    int _sfm_parts = 0;
+    int _num_threads = 0;
+    int _io_threads = 2;
     sfmData::SfMData _sfm_data;
+    std::vector<std::vector<int>> _landmark_cameras;
+    std::unique_ptr<ImageCache> _image_cache;
+    MatrixXu8 _landmark_colors;
 };
 
 
@@ -0,0 +1,293 @@
+#include "depth_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+// Scratch buffers are thread_local: a worker converting frame after frame reuses them and stops allocating
+// once they have grown to the frame size.
+namespace utils {
+namespace depth {
+    namespace {
+        struct Tap {
+            int i0, i1;
+            float w1;
+        };
+
+        // source taps of every destination coordinate, clamped to the border like cv::resize
+        void computeTaps(int src_size, int dst_size, vector<Tap> &taps) {
+            taps.resize(dst_size);
+            const float scale = (float) src_size / dst_size;
+            for (int d = 0; d < dst_size; ++d) {
+                float s = (d + 0.5f) * scale - 0.5f;
+                int i0 = (int) floor(s);
+                float w1 = s - i0;
+                if (i0 < 0) {
+                    i0 = 0;
+                    w1 = 0.0f;
+                }
+                if (i0 >= src_size - 1) {
+                    i0 = src_size - 1;
+                    w1 = 0.0f;
+                }
+                // a tap without weight must not spread an invalid neighbor
+                taps[d] = {i0, w1 > 0.0f ? std::min(i0 + 1, src_size - 1) : i0, w1};
+            }
+        }
+    };
+
+    namespace {
+        // zero for invalid source pixels, which then carry no weight
+        void maskDepth(const float *src, size_t size, const uint8_t *confidence,
+                       uint8_t min_confidence, float max_depth, vector<float> &masked) {
+            masked.resize(size);
+            for (size_t i = 0; i < size; ++i) {
+                const float d = src[i];
+                const bool valid = d > 0.0f && d <= max_depth && (!confidence || confidence[i] >= min_confidence);
+                masked[i] = valid ? d : 0.0f;
+            }
+        }
+    };
+
+    DepthStats resampleDepth(const float *src, int src_width, int src_height,
+                             const uint8_t *confidence, uint8_t min_confidence, float max_depth,
+                             float *dst, int dst_width, int dst_height) {
+        // invalid source pixels become NaN, which every interpolation touching them propagates
+        const float nan = numeric_limits<float>::quiet_NaN();
+        const size_t src_size = (size_t) src_width * src_height;
+        thread_local vector<float> masked;
+        masked.resize(src_size);
+        for (size_t i = 0; i < src_size; ++i) {
+            const float d = src[i];
+            const bool valid = d > 0.0f && d <= max_depth && (!confidence || confidence[i] >= min_confidence);
+            masked[i] = valid ? d : nan;
+        }
+
+        thread_local vector<Tap> x_taps, y_taps;
+        computeTaps(src_width, dst_width, x_taps);
+        computeTaps(src_height, dst_height, y_taps);
+
+        float min_depth = numeric_limits<float>::max();
+        float max_value = numeric_limits<float>::lowest();
+        int valid_count = 0;
+        for (int y = 0; y < dst_height; ++y) {
+            const Tap &ty = y_taps[y];
+            const float *r0 = masked.data() + (size_t) ty.i0 * src_width;
+            const float *r1 = masked.data() + (size_t) ty.i1 * src_width;
+            float *out = dst + (size_t) y * dst_width;
+            // interpolation, masking and statistics in a single sweep over the output row
+            for (int x = 0; x < dst_width; ++x) {
+                const Tap &tx = x_taps[x];
+                const float top = r0[tx.i0] + tx.w1 * (r0[tx.i1] - r0[tx.i0]);
+                const float bottom = r1[tx.i0] + tx.w1 * (r1[tx.i1] - r1[tx.i0]);
+                const float v = top + ty.w1 * (bottom - top);
+                const bool valid = v == v;
+                out[x] = valid ? v : -1.0f;
+                if (valid) {
+                    min_depth = std::min(min_depth, v);
+                    max_value = std::max(max_value, v);
+                    ++valid_count;
+                }
+            }
+        }
+
+        DepthStats stats;
+        if (valid_count) {
+            stats.min_depth = min_depth;
+            stats.max_depth = max_value;
+            stats.valid_count = valid_count;
+        }
+        return stats;
+    }
+
+    DepthStats upsampleDepthGuided(const float *src, int src_width, int src_height,
+                                   const uint8_t *confidence, uint8_t min_confidence, float max_depth,
+                                   const uint8_t *guide, float *dst, int dst_width, int dst_height,
+                                   int radius, float sigma_spatial, float sigma_range) {
+        thread_local vector<float> masked, guide_sum, guide_low, weights_x, weights_y;
+        thread_local vector<int> guide_count, src_x, first_x, first_y;
+        maskDepth(src, (size_t) src_width * src_height, confidence, min_confidence, max_depth, masked);
+
+        // luma of every source pixel footprint, the box average of the guide pixels falling into it
+        guide_sum.assign((size_t) src_width * src_height, 0.0f);
+        guide_count.assign(guide_sum.size(), 0);
+        const float sx = (float) src_width / dst_width;
+        const float sy = (float) src_height / dst_height;
+        src_x.resize(dst_width);
+        for (int x = 0; x < dst_width; ++x)
+            src_x[x] = std::min((int) ((x + 0.5f) * sx), src_width - 1);
+        for (int y = 0; y < dst_height; ++y) {
+            const int row = std::min((int) ((y + 0.5f) * sy), src_height - 1) * src_width;
+            const uint8_t *g = guide + (size_t) y * dst_width;
+            for (int x = 0; x < dst_width; ++x) {
+                guide_sum[row + src_x[x]] += g[x];
+                ++guide_count[row + src_x[x]];
+            }
+        }
+        guide_low.resize(guide_sum.size());
+        for (size_t i = 0; i < guide_low.size(); ++i)
+            guide_low[i] = guide_count[i] ? guide_sum[i] / guide_count[i] : 0.0f;
+
+        // the spatial weight is separable: per output column and row, the weights of the 2 radius + 1 taps
+        const int taps = 2 * radius + 1;
+        auto spatial_weights = [&](int dst_size, float scale, int src_size, vector<int> &first, vector<float> &weights) {
+            first.resize(dst_size);
+            weights.assign((size_t) dst_size * taps, 0.0f);
+            for (int d = 0; d < dst_size; ++d) {
+                const float s = (d + 0.5f) * scale - 0.5f;
+                const int center = (int) floor(s + 0.5f);
+                first[d] = center - radius;
+                for (int t = 0; t < taps; ++t) {
+                    const int i = center - radius + t;
+                    if (i < 0 || i >= src_size)
+                        continue;
+                    const float dist = s - i;
+                    weights[(size_t) d * taps + t] = exp(-dist * dist / (2.0f * sigma_spatial * sigma_spatial));
+                }
+            }
+        };
+        spatial_weights(dst_width, sx, src_width, first_x, weights_x);
+        spatial_weights(dst_height, sy, src_height, first_y, weights_y);
+
+        float range_lut[256];
+        for (int d = 0; d < 256; ++d)
+            range_lut[d] = exp(-(float) (d * d) / (2.0f * sigma_range * sigma_range));
+
+        float min_depth = numeric_limits<float>::max();
+        float max_value = numeric_limits<float>::lowest();
+        int valid_count = 0;
+        for (int y = 0; y < dst_height; ++y) {
+            const uint8_t *g = guide + (size_t) y * dst_width;
+            float *out = dst + (size_t) y * dst_width;
+            const float *wy = weights_y.data() + (size_t) y * taps;
+            for (int x = 0; x < dst_width; ++x) {
+                const float *wx = weights_x.data() + (size_t) x * taps;
+                const float luma = g[x];
+                float sum = 0.0f, weight = 0.0f;
+                for (int ty = 0; ty < taps; ++ty) {
+                    if (wy[ty] == 0.0f)
+                        continue;
+                    const size_t row = (size_t) (first_y[y] + ty) * src_width;
+                    for (int tx = 0; tx < taps; ++tx) {
+                        const size_t i = row + first_x[x] + tx;
+                        if (wx[tx] == 0.0f || masked[i] == 0.0f)
+                            continue;
+                        const int diff = std::min((int) fabs(luma - guide_low[i]), 255);
+                        const float w = wy[ty] * wx[tx] * range_lut[diff];
+                        sum += w * masked[i];
+                        weight += w;
+                    }
+                }
+                if (weight > 1e-6f) {
+                    const float v = sum / weight;
+                    out[x] = v;
+                    min_depth = std::min(min_depth, v);
+                    max_value = std::max(max_value, v);
+                    ++valid_count;
+                }
+                else {
+                    out[x] = -1.0f;
+                }
+            }
+        }
+
+        DepthStats stats;
+        if (valid_count) {
+            stats.min_depth = min_depth;
+            stats.max_depth = max_value;
+            stats.valid_count = valid_count;
+        }
+        return stats;
+    }
+
+    void computeSimMap(const float *depth, int width, int height,
+                       const uint8_t *confidence, int conf_width, int conf_height, float *sim) {
+        // ARKit confidence levels 0 (low), 1 (medium) and 2 (high)
+        const float level_sim[3] = {0.0f, -0.5f, -1.0f};
+        thread_local vector<int> src_x;
+        src_x.resize(width);
+        for (int x = 0; x < width; ++x)
+            src_x[x] = std::min((int) ((x + 0.5f) * conf_width / width), conf_width - 1);
+        for (int y = 0; y < height; ++y) {
+            const float *d = depth + (size_t) y * width;
+            float *out = sim + (size_t) y * width;
+            if (!confidence) {
+                for (int x = 0; x < width; ++x)
+                    out[x] = d[x] > 0.0f ? -1.0f : 1.0f;
+                continue;
+            }
+            const uint8_t *c = confidence + (size_t) std::min((int) ((y + 0.5f) * conf_height / height), conf_height - 1) * conf_width;
+            for (int x = 0; x < width; ++x)
+                out[x] = d[x] > 0.0f ? level_sim[std::min<int>(c[src_x[x]], 2)] : 1.0f;
+        }
+    }
+
+    DepthStats filterConsistentDepth(const DepthView &ref, const vector<DepthView> &neighbors,
+                                     int row_begin, int row_end, int min_consistent, float rel_tolerance,
+                                     float *depth_out, float *sim_out) {
+        // reference camera to the pixels of every neighbor
+        const int num_neighbors = neighbors.size();
+        if (num_neighbors == 0 || num_neighbors < min_consistent) {
+            // too few neighbors to confirm any pixel
+            for (int y = row_begin; y < row_end; ++y) {
+                std::fill_n(depth_out + (size_t) y * ref.width, ref.width, -1.0f);
+                std::fill_n(sim_out + (size_t) y * ref.width, ref.width, 1.0f);
+            }
+            return DepthStats();
+        }
+        vector<Eigen::Matrix<float, 3, 4>> projections(num_neighbors);
+        for (int n = 0; n < num_neighbors; ++n) {
+            const Eigen::Matrix4f ref_to_neighbor = neighbors[n].pose.inverse() * ref.pose;
+            projections[n] = neighbors[n].K * ref_to_neighbor.topRows<3>();
+        }
+        const Eigen::Matrix3f K_inv = ref.K.inverse();
+
+        float min_depth = numeric_limits<float>::max();
+        float max_value = numeric_limits<float>::lowest();
+        int valid_count = 0;
+        for (int y = row_begin; y < row_end; ++y) {
+            const float *d = ref.depth + (size_t) y * ref.width;
+            float *out = depth_out + (size_t) y * ref.width;
+            float *sim = sim_out + (size_t) y * ref.width;
+            for (int x = 0; x < ref.width; ++x) {
+                out[x] = -1.0f;
+                sim[x] = 1.0f;
+                if (!(d[x] > 0.0f))
+                    continue;
+                const Eigen::Vector3f point = K_inv * Eigen::Vector3f(x + 0.5f, y + 0.5f, 1.0f) * d[x];
+                int consistent = 0;
+                for (int n = 0; n < num_neighbors; ++n) {
+                    const DepthView &neighbor = neighbors[n];
+                    const Eigen::Vector3f pixel = projections[n].leftCols<3>() * point + projections[n].col(3);
+                    if (pixel(2) <= 0.0f)
+                        continue;
+                    const int u = (int) (pixel(0) / pixel(2));
+                    const int v = (int) (pixel(1) / pixel(2));
+                    if (u < 0 || u >= neighbor.width || v < 0 || v >= neighbor.height)
+                        continue;
+                    const float neighbor_depth = neighbor.depth[(size_t) v * neighbor.width + u];
+                    if (neighbor_depth > 0.0f && fabs(neighbor_depth - pixel(2)) < rel_tolerance * pixel(2))
+                        ++consistent;
+                }
+                if (consistent < min_consistent)
+                    continue;
+                out[x] = d[x];
+                sim[x] = -(float) consistent / num_neighbors;
+                min_depth = std::min(min_depth, d[x]);
+                max_value = std::max(max_value, d[x]);
+                ++valid_count;
+            }
+        }
+
+        DepthStats stats;
+        if (valid_count) {
+            stats.min_depth = min_depth;
+            stats.max_depth = max_value;
+            stats.valid_count = valid_count;
+        }
+        return stats;
+    }
+};
+};
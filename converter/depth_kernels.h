@@ -0,0 +1,63 @@
+#ifndef DEPTH_KERNELS_H
+#define DEPTH_KERNELS_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace utils {
+namespace depth {
+    struct DepthStats {
+        float min_depth = 0.0f;
+        float max_depth = 0.0f;
+        int valid_count = 0;
+    };
+
+    // Bilinearly resample a src_width x src_height depth frame to dst_width x dst_height in a single pass,
+    // with the pixel center alignment of cv::resize. Source pixels that are zero, beyond max_depth or below
+    // min_confidence are invalid, as is every output pixel interpolated with weight from one of them.
+    // Invalid output pixels are written as -1. Returns the range and count of the valid output depths.
+    DepthStats resampleDepth(const float *src, int src_width, int src_height,
+                             const uint8_t *confidence, uint8_t min_confidence, float max_depth,
+                             float *dst, int dst_width, int dst_height);
+
+    // Joint bilateral upsampling of a depth frame to the resolution of an 8-bit luma guide. Every output
+    // pixel averages the valid source depths of a (2 radius + 1)^2 window, weighted by their distance in
+    // source pixels and by the difference between the output luma and the luma of the source pixel footprint,
+    // so depth edges follow the color edges instead of being blurred. Masking and statistics as resampleDepth.
+    DepthStats upsampleDepthGuided(const float *src, int src_width, int src_height,
+                                   const uint8_t *confidence, uint8_t min_confidence, float max_depth,
+                                   const uint8_t *guide, float *dst, int dst_width, int dst_height,
+                                   int radius = 1, float sigma_spatial = 1.0f, float sigma_range = 12.0f);
+
+    // Meshroom similarity map of a converted depth map: from -1, the best similarity, for high ARKit confidence
+    // to 0 for low confidence, and 1 where depth is invalid. The confidence of the source pixel covering each
+    // output pixel is used; without confidence every valid pixel gets -1.
+    void computeSimMap(const float *depth, int width, int height,
+                       const uint8_t *confidence, int conf_width, int conf_height, float *sim);
+
+    // A depth map along the camera z axis, as written by assignSensorDepth, with the intrinsics at its
+    // resolution and the camera pose (camera to world)
+    struct DepthView {
+        const float *depth = nullptr;
+        int width = 0, height = 0;
+        Eigen::Matrix3f K;
+        Eigen::Matrix4f pose;
+    };
+
+    // Multi-view consistency of rows [row_begin, row_end) of the reference depth map. A pixel is kept if at least
+    // min_consistent neighbor views see its back-projected point at a depth within rel_tolerance; its similarity
+    // is minus the fraction of consistent neighbors. Rejected and invalid pixels get depth -1 and similarity 1, as do
+    // all pixels when there are fewer than min_consistent neighbors, or none.
+    DepthStats filterConsistentDepth(const DepthView &ref, const std::vector<DepthView> &neighbors,
+                                     int row_begin, int row_end, int min_consistent, float rel_tolerance,
+                                     float *depth_out, float *sim_out);
+};
+};
+
+
+#endif //DEPTH_KERNELS_H
@@ -0,0 +1,107 @@
+#include "depth_points.h"
+
+#include <omp.h>
+
+using namespace std;
+
+DepthPointCloud::DepthPointCloud(float voxel_size) : _voxel_size(voxel_size) {
+    _thread_voxels.resize(1);
+}
+
+void DepthPointCloud::setThreadNum(int num_threads) {
+    if (num_threads > (int) _thread_voxels.size())
+        _thread_voxels.resize(num_threads);
+}
+
+uint64_t DepthPointCloud::voxelKey(const Eigen::Vector3f &point) const {
+    // 21 bits per axis centered on the origin, cells beyond that range are clamped to the border
+    const int64_t half_cell = 1 << 20;
+    const int64_t max_cell = (1 << 21) - 1;
+    Eigen::Vector3f cell = (point / _voxel_size).array().floor();
+    uint64_t key = 0;
+    for (int d = 0; d < 3; ++d) {
+        int64_t c = std::min<int64_t>(std::max<int64_t>((int64_t) cell(d) + half_cell, 0), max_cell);
+        key |= (uint64_t) c << (21 * d);
+    }
+    return key;
+}
+
+void DepthPointCloud::integrate(int cam_idx, const float *depth, int width, int height,
+                                const Eigen::Matrix3f &K, const Eigen::Matrix4f &pose,
+                                const uint8_t *confidence, uint8_t min_confidence, float max_depth) {
+    VoxelMap &voxels = _thread_voxels[omp_get_thread_num()];
+
+    const Eigen::Matrix3f K_inv = K.inverse();
+    const Eigen::Matrix3f rotation = pose.block<3, 3>(0, 0);
+    const Eigen::Vector3f translation = pose.block<3, 1>(0, 3);
+    const float cx = 0.5f * width;
+    const float cy = 0.5f * height;
+
+    for (int v = 0; v < height; ++v) {
+        for (int u = 0; u < width; ++u) {
+            const int i = v * width + u;
+            const float d = depth[i];
+            if (!(d > 0.0f) || d > max_depth)
+                continue;
+            if (confidence && confidence[i] < min_confidence)
+                continue;
+
+            const Eigen::Vector3f ray = K_inv * Eigen::Vector3f(u + 0.5f, v + 0.5f, 1.0f);
+            const Eigen::Vector3f point = rotation * (ray * d) + translation;
+            Voxel &voxel = voxels[voxelKey(point)];
+            voxel.sum += point;
+            ++voxel.count;
+
+            // a frame is integrated by a single thread, its samples of a voxel are contiguous
+            const float dist = std::sqrt((u + 0.5f - cx) * (u + 0.5f - cx) + (v + 0.5f - cy) * (v + 0.5f - cy));
+            if (voxel.views.empty() || voxel.views.back().first != cam_idx)
+                voxel.views.emplace_back(cam_idx, dist);
+            else
+                voxel.views.back().second = std::min(voxel.views.back().second, dist);
+        }
+    }
+}
+
+void DepthPointCloud::extract(MatrixXf &positions, vector<vector<int>> &cameras, vector<vector<float>> &scores,
+                              int min_views) {
+    Timer<> timer;
+    VoxelMap &merged = _thread_voxels[0];
+    for (size_t t = 1; t < _thread_voxels.size(); ++t) {
+        for (auto &entry : _thread_voxels[t]) {
+            Voxel &voxel = merged[entry.first];
+            voxel.sum += entry.second.sum;
+            voxel.count += entry.second.count;
+            voxel.views.insert(voxel.views.end(), entry.second.views.begin(), entry.second.views.end());
+        }
+        VoxelMap().swap(_thread_voxels[t]);
+    }
+
+    // output in key order, so that the landmarks do not depend on the thread schedule
+    vector<uint64_t> keys;
+    keys.reserve(merged.size());
+    for (const auto &entry : merged) {
+        if (entry.second.views.size() >= (size_t) min_views)
+            keys.emplace_back(entry.first);
+    }
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    const int num_points = keys.size();
+    positions.resize(3, num_points);
+    cameras.assign(num_points, vector<int>());
+    scores.assign(num_points, vector<float>());
+    for (int p = 0; p < num_points; ++p) {
+        Voxel &voxel = merged.at(keys[p]);
+        std::sort(voxel.views.begin(), voxel.views.end());
+        positions.col(p) = voxel.sum / (float) voxel.count;
+        cameras[p].reserve(voxel.views.size());
+        scores[p].reserve(voxel.views.size());
+        for (const auto &view : voxel.views) {
+            cameras[p].emplace_back(view.first);
+            scores[p].emplace_back(view.second);
+        }
+    }
+
+    cout << merged.size() << " voxels of size " << _voxel_size << ", " << num_points << " seen by at least "
+         << min_views << " views (took " << timeString(timer.value()) << ")" << endl;
+    VoxelMap().swap(merged);
+}
@@ -0,0 +1,54 @@
+#ifndef DEPTH_POINTS_H
+#define DEPTH_POINTS_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <unordered_map>
+#include <vector>
+
+#include "utils.h"
+#include <common.h>
+
+// Voxel-hashed point set built from back-projected ARKit depth frames.
+// Every voxel keeps the centroid of its samples and the cameras it was seen from,
+// which become landmark observations without linking mesh vertices.
+class DepthPointCloud {
+public:
+    explicit DepthPointCloud(float voxel_size);
+
+    // One voxel map per thread of the OpenMP team integrating frames, called from a single thread of that
+    // team with omp_get_num_threads() before the frames are integrated
+    void setThreadNum(int num_threads);
+
+    // Back-project a depth frame of camera cam_idx with intrinsics K at the depth resolution and
+    // the camera pose. Pixels beyond max_depth or with confidence below min_confidence are skipped.
+    // Frames can be integrated concurrently from the threads of the team passed to setThreadNum.
+    void integrate(int cam_idx, const float *depth, int width, int height,
+                   const Eigen::Matrix3f &K, const Eigen::Matrix4f &pose,
+                   const uint8_t *confidence = nullptr, uint8_t min_confidence = 0, float max_depth = 4.0f);
+
+    // Merge the per-thread voxels into positions (3 x N) and the cameras seeing each of them,
+    // scored by the distance of the observation to the image center in pixels of the depth frame.
+    // Voxels seen by fewer than min_views cameras are dropped. The accumulated voxels are released.
+    void extract(MatrixXf &positions, std::vector<std::vector<int>> &cameras, std::vector<std::vector<float>> &scores,
+                 int min_views = 2);
+
+    inline float getVoxelSize() const { return _voxel_size; }
+
+private:
+    struct Voxel {
+        Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+        uint32_t count = 0;
+        std::vector<std::pair<int, float>> views;
+    };
+    typedef std::unordered_map<uint64_t, Voxel> VoxelMap;
+
+    uint64_t voxelKey(const Eigen::Vector3f &point) const;
+
+    float _voxel_size;
+    std::vector<VoxelMap> _thread_voxels;
+};
+
+
+#endif //DEPTH_POINTS_H
@@ -0,0 +1,116 @@
+#include "depth_source.h"
+
+#include <aliceVision/mvsData/imageIO.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "utils.h"
+
+namespace fs = std::experimental::filesystem;
+using namespace std;
+using namespace aliceVision;
+
+DepthFolderSource::DepthFolderSource(const string &folder) : _folder(fs::absolute(folder).string()) {}
+
+bool DepthFolderSource::read(int cam_idx, int &width, int &height, vector<float> &depth) {
+    // depth frames are named after the camera index, like the color frames
+    const string depth_path = _folder + "/" + to_string(cam_idx) + ".exr";
+    if (!utils::io::pathExists(depth_path))
+        return false;
+    imageIO::readImage(depth_path, width, height, depth, imageIO::EImageColorSpace::NO_CONVERSION);
+    return width > 0 && height > 0;
+}
+
+DepthStreamSource::DepthStreamSource(const string &filepath, int width, int height, const FrameSampling &sampling)
+    : _filepath(filepath), _reader(filepath, (size_t) width * height * sizeof(uint16_t)), _width(width), _height(height),
+      _sampling(sampling), _half((size_t) width * height) {}
+
+namespace {
+    // skip to the frame of camera cam_idx, streams are only read forward
+    bool seekFrame(ZlibFrameReader &reader, int cam_idx, const FrameSampling &sampling) {
+        const size_t frame_idx = sampling.frameIndex(cam_idx);
+        if (frame_idx < reader.getFrameIndex()) {
+            cerr << "Frame " << frame_idx << " requested after frame " << reader.getFrameIndex()
+                 << ", the stream only reads forward" << endl;
+            return false;
+        }
+        return reader.skip(frame_idx - reader.getFrameIndex());
+    }
+};
+
+void DepthFolderSource::hashFrame(int cam_idx, FrameHash &hash) const {
+    hash.addFile(_folder + "/" + to_string(cam_idx) + ".exr");
+}
+
+void DepthStreamSource::hashFrame(int cam_idx, FrameHash &hash) const {
+    // the whole stream stands for each of its frames
+    hash.addFile(_filepath).add((uint64_t) _sampling.frameIndex(cam_idx)).add(_width).add(_height);
+}
+
+bool DepthStreamSource::read(int cam_idx, int &width, int &height, vector<float> &depth) {
+    if (!seekFrame(_reader, cam_idx, _sampling) || !_reader.read(_half.data()))
+        return false;
+
+    width = _width;
+    height = _height;
+    depth.resize(_half.size());
+    for (size_t i = 0; i < _half.size(); ++i)
+        depth[i] = utils::halfToFloat(_half[i]);
+    return true;
+}
+
+ConfidenceFolderSource::ConfidenceFolderSource(const string &folder) : _folder(fs::absolute(folder).string()) {}
+
+bool ConfidenceFolderSource::read(int cam_idx, int &width, int &height, vector<uint8_t> &confidence) {
+    cv::Mat image = cv::imread(_folder + "/" + to_string(cam_idx) + ".png", cv::IMREAD_UNCHANGED);
+    if (image.empty() || image.type() != CV_8UC1)
+        return false;
+    width = image.cols;
+    height = image.rows;
+    confidence.assign(image.ptr<uint8_t>(), image.ptr<uint8_t>() + image.total());
+    return true;
+}
+
+ConfidenceStreamSource::ConfidenceStreamSource(const string &filepath, int width, int height, const FrameSampling &sampling)
+    : _filepath(filepath), _reader(filepath, (size_t) width * height), _width(width), _height(height), _sampling(sampling) {}
+
+void ConfidenceFolderSource::hashFrame(int cam_idx, FrameHash &hash) const {
+    hash.addFile(_folder + "/" + to_string(cam_idx) + ".png");
+}
+
+void ConfidenceStreamSource::hashFrame(int cam_idx, FrameHash &hash) const {
+    hash.addFile(_filepath).add((uint64_t) _sampling.frameIndex(cam_idx)).add(_width).add(_height);
+}
+
+bool ConfidenceStreamSource::read(int cam_idx, int &width, int &height, vector<uint8_t> &confidence) {
+    confidence.resize((size_t) _width * _height);
+    if (!seekFrame(_reader, cam_idx, _sampling) || !_reader.read(confidence.data()))
+        return false;
+    width = _width;
+    height = _height;
+    return true;
+}
+
+unique_ptr<DepthSource> openDepthSource(const string &path, int width, int height, const FrameSampling &sampling) {
+    if (utils::io::checkExtension(path, ".zlib")) {
+        unique_ptr<DepthStreamSource> stream(new DepthStreamSource(path, width, height, sampling));
+        if (!stream->isOpen())
+            return nullptr;
+        return std::move(stream);
+    }
+    if (!utils::io::pathExists(path))
+        return nullptr;
+    return unique_ptr<DepthSource>(new DepthFolderSource(path));
+}
+
+unique_ptr<ConfidenceSource> openConfidenceSource(const string &path, int width, int height, const FrameSampling &sampling) {
+    if (utils::io::checkExtension(path, ".zlib")) {
+        unique_ptr<ConfidenceStreamSource> stream(new ConfidenceStreamSource(path, width, height, sampling));
+        if (!stream->isOpen())
+            return nullptr;
+        return std::move(stream);
+    }
+    if (!utils::io::pathExists(path))
+        return nullptr;
+    return unique_ptr<ConfidenceSource>(new ConfidenceFolderSource(path));
+}
@@ -0,0 +1,99 @@
+#ifndef DEPTH_SOURCE_H
+#define DEPTH_SOURCE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "zlib_stream.h"
+#include "frame_manifest.h"
+#include "frame_sampling.h"
+
+// Source of the ARKit depth frames of the sampled cameras, in meters
+class DepthSource {
+public:
+    virtual ~DepthSource() = default;
+
+    // Read the depth frame of camera cam_idx, false if it is missing or unreadable
+    virtual bool read(int cam_idx, int& width, int& height, std::vector<float>& depth) = 0;
+    // Frames of a sequential source must be read in increasing camera order, one at a time
+    virtual bool isSequential() const { return false; }
+    // Add the file holding the frame of camera cam_idx, and where it is in the file, without reading it
+    virtual void hashFrame(int cam_idx, FrameHash& hash) const = 0;
+};
+
+// Folder of decoded <cam_idx>.exr depth frames
+class DepthFolderSource : public DepthSource {
+public:
+    explicit DepthFolderSource(const std::string& folder);
+    bool read(int cam_idx, int& width, int& height, std::vector<float>& depth) override;
+    void hashFrame(int cam_idx, FrameHash& hash) const override;
+
+private:
+    std::string _folder;
+};
+
+// <scanID>.depth.zlib stream of half float frames, inflated on the fly. Frames between the sampled
+// cameras are inflated into scratch memory and dropped, nothing is written to disk.
+class DepthStreamSource : public DepthSource {
+public:
+    DepthStreamSource(const std::string& filepath, int width, int height, const FrameSampling& sampling);
+    bool read(int cam_idx, int& width, int& height, std::vector<float>& depth) override;
+    bool isSequential() const override { return true; }
+    void hashFrame(int cam_idx, FrameHash& hash) const override;
+
+    inline bool isOpen() const { return _reader.isOpen(); }
+
+private:
+    std::string _filepath;
+    ZlibFrameReader _reader;
+    int _width, _height;
+    FrameSampling _sampling;
+    std::vector<uint16_t> _half;
+};
+
+// Source of the ARKit confidence levels of the depth frames, 0 (low) to 2 (high)
+class ConfidenceSource {
+public:
+    virtual ~ConfidenceSource() = default;
+
+    virtual bool read(int cam_idx, int& width, int& height, std::vector<uint8_t>& confidence) = 0;
+    virtual bool isSequential() const { return false; }
+    virtual void hashFrame(int cam_idx, FrameHash& hash) const = 0;
+};
+
+// Folder of decoded 8-bit <cam_idx>.png confidence maps
+class ConfidenceFolderSource : public ConfidenceSource {
+public:
+    explicit ConfidenceFolderSource(const std::string& folder);
+    bool read(int cam_idx, int& width, int& height, std::vector<uint8_t>& confidence) override;
+    void hashFrame(int cam_idx, FrameHash& hash) const override;
+
+private:
+    std::string _folder;
+};
+
+// <scanID>.confidence.zlib stream of 8-bit frames, inflated on the fly like the depth stream
+class ConfidenceStreamSource : public ConfidenceSource {
+public:
+    ConfidenceStreamSource(const std::string& filepath, int width, int height, const FrameSampling& sampling);
+    bool read(int cam_idx, int& width, int& height, std::vector<uint8_t>& confidence) override;
+    bool isSequential() const override { return true; }
+    void hashFrame(int cam_idx, FrameHash& hash) const override;
+
+    inline bool isOpen() const { return _reader.isOpen(); }
+
+private:
+    std::string _filepath;
+    ZlibFrameReader _reader;
+    int _width, _height;
+    FrameSampling _sampling;
+};
+
+// Open a folder of depth frames, or a .zlib depth stream of frames of the given size sampled every step frames
+std::unique_ptr<DepthSource> openDepthSource(const std::string& path, int width, int height, const FrameSampling& sampling);
+// Open a folder of confidence maps, or a .zlib confidence stream
+std::unique_ptr<ConfidenceSource> openConfidenceSource(const std::string& path, int width, int height, const FrameSampling& sampling);
+
+
+#endif //DEPTH_SOURCE_H
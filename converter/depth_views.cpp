@@ -0,0 +1,65 @@
+#include "depth_views.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace fs = std::experimental::filesystem;
+using namespace std;
+
+DepthViews::DepthViews(const sfmData::SfMData &sfm_data, const ObvLinker &linker, int downscale)
+    : _downscale(std::max(downscale, 1)), _width(linker.getImageWidth() / _downscale),
+      _height(linker.getImageHeight() / _downscale) {
+    const RowMatrixX9f &intrinsics_array = linker.getIntrinsicsArray();
+    const RowMatrixX16f &transform_array = linker.getTransformArray();
+    const int num_cam = std::min<int>(intrinsics_array.rows(), transform_array.rows());
+
+    int skipped = 0;
+    for (const auto &view_iter : sfm_data.getViews()) {
+        const sfmData::View &view = *view_iter.second;
+        // frames are named after their index in the sampled trajectory
+        const string stem = fs::path(view.getImagePath()).stem().string();
+        if (stem.empty() || !all_of(stem.begin(), stem.end(), ::isdigit) || stoi(stem) >= num_cam) {
+            ++skipped;
+            continue;
+        }
+
+        View depth_view;
+        depth_view.view_id = view.getViewId();
+        depth_view.cam_idx = stoi(stem);
+        depth_view.view = &view;
+
+        // intrinsics are column-major, the pose maps the camera to the world
+        RowMatrixX9f::ConstRowXpr intrinsics_row = intrinsics_array.row(depth_view.cam_idx);
+        Eigen::Matrix3d K = Eigen::Map<const Eigen::Matrix3f>(intrinsics_row.data(), 3, 3).cast<double>();
+        K /= K(2, 2);
+        RowMatrixX16f::ConstRowXpr transform_row = transform_array.row(depth_view.cam_idx);
+        Eigen::Matrix4d pose = Eigen::Map<const Eigen::Matrix4f>(transform_row.data(), 4, 4).cast<double>();
+        pose /= pose(3, 3);
+
+        depth_view.center = pose.block<3, 1>(0, 3);
+        depth_view.projection = K * pose.inverse().topRows<3>();
+        // iCamArr maps the pixels of the downscaled depth map, as mvsUtils::MultiViewParams scales it
+        Eigen::Matrix3d K_scaled = K;
+        K_scaled.topRows<2>() /= _downscale;
+        depth_view.inv_camera = (K_scaled * pose.topLeftCorner<3, 3>().transpose()).inverse();
+        _views.emplace_back(depth_view);
+    }
+    if (skipped)
+        cerr << skipped << " views are not frames of the trajectory, no depth map is written for them" << endl;
+}
+
+vector<double> DepthViews::getProjection44(int rc) const {
+    vector<double> projection(16, 0.0);
+    Eigen::Map<Eigen::Matrix<double, 4, 4, Eigen::RowMajor>> map(projection.data());
+    map.topRows<3>() = _views[rc].projection;
+    map(3, 3) = 1.0;
+    return projection;
+}
+
+string DepthViews::getDepthMapPath(const string &folder, int rc) const {
+    return (fs::absolute(folder) / (to_string(_views[rc].view_id) + "_depthMap.exr")).string();
+}
+
+string DepthViews::getSimMapPath(const string &folder, int rc) const {
+    return (fs::absolute(folder) / (to_string(_views[rc].view_id) + "_simMap.exr")).string();
+}
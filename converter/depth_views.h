@@ -0,0 +1,66 @@
+#ifndef DEPTH_VIEWS_H
+#define DEPTH_VIEWS_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "obv_linker.h"
+
+// The cameras of the depth maps written for Meshroom, as mvsUtils::MultiViewParams describes them, built from the
+// ARKit poses and intrinsics of the linker and the views of the SfMData. MultiViewParams opens every image of
+// the dense scene folder for its size and metadata before the first frame can be written; here the image size
+// comes from <scanID>.json and the metadata from the views, so no image is read.
+class DepthViews {
+public:
+    typedef Eigen::Matrix<double, 3, 3, Eigen::RowMajor> Matrix3d;
+    typedef Eigen::Matrix<double, 3, 4, Eigen::RowMajor> Matrix34d;
+
+    // Views whose image is not named after a camera of the trajectory are left out.
+    // The depth maps are the image size divided by downscale.
+    DepthViews(const sfmData::SfMData &sfm_data, const ObvLinker &linker, int downscale = 1);
+
+    inline int size() const { return _views.size(); }
+    inline IndexT getViewId(int rc) const { return _views[rc].view_id; }
+    inline int getCamIndex(int rc) const { return _views[rc].cam_idx; }
+    inline const std::string& getImagePath(int rc) const { return _views[rc].view->getImagePath(); }
+    inline const std::map<std::string, std::string>& getMetadata(int rc) const { return _views[rc].view->getMetadata(); }
+    inline int getDownscale() const { return _downscale; }
+    // depth map size
+    inline int getWidth(int rc) const { return _width; }
+    inline int getHeight(int rc) const { return _height; }
+
+    // camera center in world coordinates
+    inline const Eigen::Vector3d& getCenter(int rc) const { return _views[rc].center; }
+    // world to image pixel projection at the full image resolution
+    inline const Matrix34d& getProjection(int rc) const { return _views[rc].projection; }
+    // inverse of K R with K at the depth map resolution, depth map pixels to world ray directions
+    inline const Matrix3d& getInverseCamera(int rc) const { return _views[rc].inv_camera; }
+    // 4 x 4 row-major projection, as AliceVision:P is stored
+    std::vector<double> getProjection44(int rc) const;
+
+    // <folder>/<viewId>_depthMap.exr and <folder>/<viewId>_simMap.exr, as the DepthMap node names them
+    std::string getDepthMapPath(const std::string &folder, int rc) const;
+    std::string getSimMapPath(const std::string &folder, int rc) const;
+
+private:
+    struct View {
+        IndexT view_id;
+        int cam_idx;
+        const sfmData::View *view;
+        Eigen::Vector3d center;
+        Matrix34d projection;
+        Matrix3d inv_camera;
+    };
+
+    int _downscale;
+    int _width;
+    int _height;
+    std::vector<View> _views;
+};
+
+
+#endif //DEPTH_VIEWS_H
@@ -0,0 +1,114 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <common.h>
+
+// Thread-safe LRU cache of decoded frames under a memory budget. Concurrent requests for the same key wait
+// for a single load. Frames handed out stay valid after eviction, so the budget bounds the cache but not the
+// frames still in use by callers.
+template <typename Key, typename Value>
+class FrameCache {
+public:
+    typedef std::shared_ptr<const Value> Pointer;
+    // load a frame, an empty pointer if it cannot be read
+    typedef std::function<Pointer(const Key&)> Loader;
+    typedef std::function<size_t(const Value&)> Sizer;
+
+    FrameCache(size_t budget_bytes, Loader loader, Sizer sizer)
+        : _budget_bytes(budget_bytes), _loader(loader), _sizer(sizer) {}
+
+    Pointer get(const Key &key) {
+        std::promise<Pointer> promise;
+        Frame frame;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _entries.find(key);
+            if (it != _entries.end()) {
+                ++_hits;
+                _lru.splice(_lru.begin(), _lru, it->second.lru);
+                frame = it->second.frame;
+            }
+            else {
+                ++_misses;
+                _lru.push_front(key);
+                Entry &entry = _entries[key];
+                entry.frame = promise.get_future().share();
+                entry.lru = _lru.begin();
+            }
+        }
+        // another thread loads this frame, or it is cached already
+        if (frame.valid())
+            return frame.get();
+
+        Pointer value;
+        try {
+            value = _loader(key);
+        } catch (const std::exception &e) {
+            std::cerr << "Unable to load a frame: " << e.what() << std::endl;
+        }
+        promise.set_value(value);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(key);
+        if (it != _entries.end()) {
+            it->second.bytes = value ? std::max<size_t>(_sizer(*value), 1) : 0;
+            _bytes += it->second.bytes;
+        }
+        evict();
+        return value;
+    }
+
+    void printStats(const std::string &name) const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::cout << name << ": " << _misses << " loaded, " << _hits << " hits, " << _evictions << " evicted, "
+                  << memString(_bytes) << " of " << memString(_budget_bytes) << " in use" << std::endl;
+    }
+
+private:
+    typedef std::shared_future<Pointer> Frame;
+    struct Entry {
+        Frame frame;
+        size_t bytes = 0;
+        typename std::list<Key>::iterator lru;
+    };
+
+    // evict least recently used frames until the cache fits the budget, requires the lock;
+    // frames being loaded have no size yet and are skipped
+    void evict() {
+        auto it = _lru.end();
+        while (_bytes > _budget_bytes && it != _lru.begin()) {
+            --it;
+            auto entry = _entries.find(*it);
+            if (!entry->second.bytes)
+                continue;
+            _bytes -= entry->second.bytes;
+            _entries.erase(entry);
+            it = _lru.erase(it);
+            ++_evictions;
+        }
+    }
+
+    size_t _budget_bytes;
+    Loader _loader;
+    Sizer _sizer;
+
+    mutable std::mutex _mutex;
+    std::unordered_map<Key, Entry> _entries;
+    std::list<Key> _lru; // most recently used first
+    size_t _bytes = 0;
+    size_t _hits = 0;
+    size_t _misses = 0;
+    size_t _evictions = 0;
+};
+
+
+#endif //FRAME_CACHE_H
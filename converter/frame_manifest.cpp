@@ -0,0 +1,147 @@
+#include "frame_manifest.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "utils.h"
+
+namespace fs = std::experimental::filesystem;
+using namespace std;
+
+FrameHash& FrameHash::add(const void *data, size_t bytes) {
+    const unsigned char *bytes_ptr = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < bytes; ++i) {
+        _value ^= bytes_ptr[i];
+        _value *= 1099511628211ull;
+    }
+    return *this;
+}
+
+FrameHash& FrameHash::addFile(const string &file_path) {
+    add(file_path);
+    std::error_code error;
+    const uintmax_t size = fs::file_size(file_path, error);
+    if (error)
+        return add(-1);
+    const fs::file_time_type time = fs::last_write_time(file_path, error);
+    add((uint64_t) size);
+    return add((int64_t) (error ? 0 : time.time_since_epoch().count()));
+}
+
+FrameManifest::FrameManifest(const string &folder, size_t save_interval)
+    : _path((fs::absolute(folder) / "manifest.json").string()), _save_interval(std::max<size_t>(save_interval, 1)) {
+    if (!utils::io::pathExists(_path))
+        return;
+    ifstream file(_path);
+    stringstream buffer;
+    buffer << file.rdbuf();
+    rapidjson::Document d;
+    d.Parse(buffer.str().c_str());
+    // an unreadable manifest only costs regenerating every frame
+    if (d.HasParseError() || !d.IsObject() || !d.HasMember("frames") || !d["frames"].IsObject()) {
+        cerr << "Ignoring the invalid manifest " << _path << endl;
+        return;
+    }
+    // frames of a version 1 manifest have no output record and are regenerated
+    for (auto &frame : d["frames"].GetObject()) {
+        if (!frame.value.IsObject() || !frame.value.HasMember("hash") || !frame.value["hash"].IsString() ||
+            !frame.value.HasMember("outputs") || !frame.value["outputs"].IsString())
+            continue;
+        Entry &entry = _frames[frame.name.GetString()];
+        entry.hash = strtoull(frame.value["hash"].GetString(), nullptr, 16);
+        entry.outputs = strtoull(frame.value["outputs"].GetString(), nullptr, 16);
+    }
+}
+
+FrameManifest::~FrameManifest() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_unsaved)
+        saveLocked();
+}
+
+uint64_t FrameManifest::hashOutputs(const vector<string> &outputs) {
+    FrameHash hash;
+    for (const string &output : outputs)
+        hash.addFile(output);
+    return hash.value();
+}
+
+bool FrameManifest::isCurrent(const string &frame, uint64_t hash, const vector<string> &outputs) const {
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _frames.find(frame);
+        if (it == _frames.end() || it->second.hash != hash)
+            return false;
+        entry = it->second;
+    }
+    for (const string &output : outputs) {
+        if (!utils::io::pathExists(output))
+            return false;
+    }
+    // outputs rewritten by a run whose record was not saved differ from the recorded ones
+    return hashOutputs(outputs) == entry.outputs;
+}
+
+void FrameManifest::record(const string &frame, uint64_t hash, const vector<string> &outputs) {
+    const Entry entry = {hash, hashOutputs(outputs)};
+    std::lock_guard<std::mutex> lock(_mutex);
+    _frames[frame] = entry;
+    if (++_unsaved >= _save_interval)
+        saveLocked();
+}
+
+bool FrameManifest::save() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return saveLocked();
+}
+
+bool FrameManifest::saveLocked() {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("version");
+    writer.Int(2);
+    writer.Key("frames");
+    writer.StartObject();
+    char hex[17];
+    for (const auto &frame : _frames) {
+        writer.Key(frame.first.c_str());
+        writer.StartObject();
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) frame.second.hash);
+        writer.Key("hash");
+        writer.String(hex);
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) frame.second.outputs);
+        writer.Key("outputs");
+        writer.String(hex);
+        writer.EndObject();
+    }
+    writer.EndObject();
+    writer.EndObject();
+
+    // replace the previous manifest only once the new one is complete
+    const string tmp_path = _path + ".tmp";
+    {
+        ofstream file(tmp_path, ios::trunc);
+        file << buffer.GetString();
+        file.close();
+        if (!file) {
+            cerr << "Unable to write the manifest " << tmp_path << endl;
+            return false;
+        }
+    }
+    std::error_code error;
+    fs::rename(tmp_path, _path, error);
+    if (error) {
+        cerr << "Unable to replace the manifest " << _path << ": " << error.message() << endl;
+        return false;
+    }
+    _unsaved = 0;
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef FRAME_MANIFEST_H
+#define FRAME_MANIFEST_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// 64-bit FNV-1a hash of the inputs and settings an output frame is made from
+class FrameHash {
+public:
+    FrameHash& add(const void *data, size_t bytes);
+    inline FrameHash& add(const std::string &value) { return add(value.data(), value.size() + 1); }
+    template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+    inline FrameHash& add(T value) { return add(&value, sizeof(T)); }
+    // a file by its path, size and modification time, as make does, without reading it;
+    // a missing file hashes differently from any existing one
+    FrameHash& addFile(const std::string &file_path);
+
+    inline uint64_t value() const { return _value; }
+
+private:
+    uint64_t _value = 14695981039346656037ull;
+};
+
+// Record of the output frames of a folder and the hashes of what they were made from, kept in
+// <folder>/manifest.json. A rerun regenerates only the frames that are missing or whose inputs or settings
+// changed. The manifest is saved every few recorded frames to a temporary file renamed over the previous one,
+// so an interrupted run leaves a complete record of the frames written so far. Every frame also records the size
+// and modification time of its output files, so a frame overwritten after the last save is not taken as current.
+class FrameManifest {
+public:
+    explicit FrameManifest(const std::string &folder, size_t save_interval = 16);
+    ~FrameManifest();
+
+    // True if the frame was recorded with this hash and all of its output files exist unchanged since
+    bool isCurrent(const std::string &frame, uint64_t hash, const std::vector<std::string> &outputs) const;
+    // Record a frame whose outputs are written, thread-safe
+    void record(const std::string &frame, uint64_t hash, const std::vector<std::string> &outputs);
+    bool save();
+
+private:
+    struct Entry {
+        uint64_t hash;
+        uint64_t outputs; // FrameHash of the output files by path, size and modification time
+    };
+
+    static uint64_t hashOutputs(const std::vector<std::string> &outputs);
+    bool saveLocked();
+
+    std::string _path;
+    size_t _save_interval;
+    size_t _unsaved = 0;
+    mutable std::mutex _mutex;
+    std::unordered_map<std::string, Entry> _frames;
+};
+
+
+#endif //FRAME_MANIFEST_H
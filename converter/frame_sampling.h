@@ -0,0 +1,19 @@
+#ifndef FRAME_SAMPLING_H
+#define FRAME_SAMPLING_H
+
+#include <cstddef>
+#include <vector>
+
+// Frame of the ARKit streams, the line of the trajectory and the frame of the video, depth and confidence streams,
+// each sampled camera is taken from: every step-th frame, unless a sharper frame of its step window was selected
+struct FrameSampling {
+    int step = 1;
+    std::vector<int> frames; // per camera, empty for every step-th frame
+
+    inline size_t frameIndex(int cam_idx) const {
+        return (size_t) cam_idx < frames.size() ? (size_t) frames[cam_idx] : (size_t) cam_idx * step;
+    }
+};
+
+
+#endif //FRAME_SAMPLING_H
@@ -0,0 +1,22 @@
+#include "image_cache.h"
+
+using namespace std;
+
+ImageCache::ImageCache(size_t budget_bytes, int downscale)
+    : _downscale(std::max(downscale, 1)),
+      _cache(budget_bytes, [this](const string &path) { return decode(path); },
+             [](const cv::Mat &image) { return image.total() * image.elemSize(); }) {}
+
+shared_ptr<const cv::Mat> ImageCache::decode(const string &path) const {
+    cv::Mat image = cv::imread(path, cv::IMREAD_COLOR);
+    if (image.empty()) {
+        cerr << "Unable to decode " << path << endl;
+        return nullptr;
+    }
+    if (_downscale > 1) {
+        cv::Mat scaled;
+        cv::resize(image, scaled, cv::Size(image.cols / _downscale, image.rows / _downscale), 0, 0, cv::INTER_AREA);
+        image = scaled;
+    }
+    return std::make_shared<const cv::Mat>(image);
+}
@@ -0,0 +1,30 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <memory>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "frame_cache.h"
+
+// Thread-safe LRU cache of decoded 8-bit BGR frames, optionally downscaled, under a memory budget
+class ImageCache {
+public:
+    explicit ImageCache(size_t budget_bytes, int downscale = 1);
+
+    // Decoded frame, or an empty pointer if the file cannot be read
+    inline std::shared_ptr<const cv::Mat> get(const std::string& path) { return _cache.get(path); }
+
+    inline int getDownscale() const { return _downscale; }
+    inline void printStats() const { _cache.printStats("Image cache"); }
+
+private:
+    std::shared_ptr<const cv::Mat> decode(const std::string& path) const;
+
+    int _downscale;
+    FrameCache<std::string, cv::Mat> _cache;
+};
+
+
+#endif //IMAGE_CACHE_H
@@ -1,14 +1,36 @@
 #include <iostream>
 #include "convert.h"
+#include "utils.h"
 
 int main(int argc, char *argv[]) {
     std::vector<std::string> args;
     std::string in_abc, in_sfm;
     std::string in_trajectory, in_mesh, in_exr, in_exr_abs;
-    std::string in_srgb;
+    std::string in_srgb, in_conf, in_video;
     std::string out_abc, out_sfm, out_mesh;
-    std::string out_srgb, out_exr;
+    std::string out_srgb, out_exr, out_exr_filtered, out_tsdf;
     int step = 1;
+    float voxel_size = 0;
+    int max_landmarks = 0;
+    float depth_voxel_size = 0;
+    int min_confidence = 1;
+    bool sample_colors = false;
+    int cache_size = 2048;
+    int sample_downscale = 1;
+    int num_threads = 0;
+    int io_threads = 2;
+    std::string depth_upsample = "bilinear";
+    std::string depth_source = "sensor";
+    bool sim_maps = false;
+    bool sharp_frames = false;
+    bool clean = false;
+    int depth_downscale = 1;
+    bool depth_half = false;
+    std::string exr_codec = "piz";
+    int filter_neighbors = 5;
+    int filter_min_views = 2;
+    float tsdf_voxel_size = 0.01f;
+    int tsdf_budget = 1024;
     bool help = false;
 
     try {
@@ -65,6 +87,20 @@ int main(int argc, char *argv[]) {
                 }
                 in_srgb = argv[i];
             }
+            else if (strcmp("--in_video", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing color video argument!" << endl;
+                    return -1;
+                }
+                in_video = argv[i];
+            }
+            else if (strcmp("--in_conf", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing confidence map folder argument!" << endl;
+                    return -1;
+                }
+                in_conf = argv[i];
+            }
             else if (strcmp("--out_abc", argv[i]) == 0) {
                 if (++i >= argc) {
                     cerr << "Missing alembic output file argument!" << endl;
@@ -107,6 +143,160 @@ int main(int argc, char *argv[]) {
                 }
                 step = std::stoi(argv[i]);
             }
+            else if (strcmp("--voxel_size", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing landmark voxel size argument!" << endl;
+                    return -1;
+                }
+                voxel_size = std::stof(argv[i]);
+            }
+            else if (strcmp("--max_landmarks", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing maximum landmark count argument!" << endl;
+                    return -1;
+                }
+                max_landmarks = std::stoi(argv[i]);
+            }
+            else if (strcmp("--depth_landmarks", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing depth landmark voxel size argument!" << endl;
+                    return -1;
+                }
+                depth_voxel_size = std::stof(argv[i]);
+            }
+            else if (strcmp("--min_confidence", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing minimum depth confidence argument!" << endl;
+                    return -1;
+                }
+                min_confidence = std::stoi(argv[i]);
+            }
+            else if (strcmp("--sample_colors", argv[i]) == 0) {
+                sample_colors = true;
+            }
+            else if (strcmp("--cache_size", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing image cache size argument!" << endl;
+                    return -1;
+                }
+                cache_size = std::stoi(argv[i]);
+            }
+            else if (strcmp("--sample_downscale", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing color sampling downscale argument!" << endl;
+                    return -1;
+                }
+                sample_downscale = std::stoi(argv[i]);
+            }
+            else if (strcmp("--threads", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing worker thread count argument!" << endl;
+                    return -1;
+                }
+                num_threads = std::stoi(argv[i]);
+            }
+            else if (strcmp("--io_threads", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing I/O thread count argument!" << endl;
+                    return -1;
+                }
+                io_threads = std::stoi(argv[i]);
+            }
+            else if (strcmp("--depth_upsample", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing depth upsampling method argument!" << endl;
+                    return -1;
+                }
+                depth_upsample = argv[i];
+                if (depth_upsample != "bilinear" && depth_upsample != "guided") {
+                    cerr << "Invalid depth upsampling method: \"" << depth_upsample << "\"!" << endl;
+                    help = true;
+                }
+            }
+            else if (strcmp("--depth_source", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing depth source argument!" << endl;
+                    return -1;
+                }
+                depth_source = argv[i];
+                if (depth_source != "sensor" && depth_source != "mesh") {
+                    cerr << "Invalid depth source: \"" << depth_source << "\"!" << endl;
+                    help = true;
+                }
+            }
+            else if (strcmp("--sharp_frames", argv[i]) == 0) {
+                sharp_frames = true;
+            }
+            else if (strcmp("--sim_maps", argv[i]) == 0) {
+                sim_maps = true;
+            }
+            else if (strcmp("--depth_downscale", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing depth map downscale argument!" << endl;
+                    return -1;
+                }
+                depth_downscale = std::stoi(argv[i]);
+            }
+            else if (strcmp("--depth_half", argv[i]) == 0) {
+                depth_half = true;
+            }
+            else if (strcmp("--exr_codec", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing EXR compression argument!" << endl;
+                    return -1;
+                }
+                exr_codec = argv[i];
+                const std::vector<std::string> codecs = {"none", "rle", "zips", "zip", "piz", "pxr24", "b44", "b44a", "dwaa", "dwab"};
+                if (std::find(codecs.begin(), codecs.end(), exr_codec) == codecs.end()) {
+                    cerr << "Invalid EXR compression: \"" << exr_codec << "\"!" << endl;
+                    help = true;
+                }
+            }
+            else if (strcmp("--clean", argv[i]) == 0) {
+                clean = true;
+            }
+            else if (strcmp("--out_exr_filtered", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing filtered depth output folder argument!" << endl;
+                    return -1;
+                }
+                out_exr_filtered = argv[i];
+            }
+            else if (strcmp("--out_tsdf", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing fused mesh output file argument!" << endl;
+                    return -1;
+                }
+                out_tsdf = argv[i];
+            }
+            else if (strcmp("--tsdf_voxel_size", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing TSDF voxel size argument!" << endl;
+                    return -1;
+                }
+                tsdf_voxel_size = std::stof(argv[i]);
+            }
+            else if (strcmp("--tsdf_budget", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing TSDF memory budget argument!" << endl;
+                    return -1;
+                }
+                tsdf_budget = std::stoi(argv[i]);
+            }
+            else if (strcmp("--filter_neighbors", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing depth filter neighbor count argument!" << endl;
+                    return -1;
+                }
+                filter_neighbors = std::stoi(argv[i]);
+            }
+            else if (strcmp("--filter_min_views", argv[i]) == 0) {
+                if (++i >= argc) {
+                    cerr << "Missing depth filter minimum view count argument!" << endl;
+                    return -1;
+                }
+                filter_min_views = std::stoi(argv[i]);
+            }
             else {
                 if (strncmp(argv[i], "-", 1) == 0) {
                     cerr << "Invalid argument: \"" << argv[i] << "\"!" << endl;
@@ -120,22 +310,95 @@ int main(int argc, char *argv[]) {
         help = true;
     }
 
+    if (depth_source == "mesh" && in_mesh.empty()) {
+        cerr << "--depth_source mesh needs --in_mesh!" << endl;
+        help = true;
+    }
+
+    // subsampling drops the faces of the mesh, it would be written as a point cloud
+    if (!out_mesh.empty() && !in_mesh.empty() && (voxel_size > 0 || max_landmarks > 0)) {
+        cerr << "--out_mesh can't be written from a mesh subsampled by --voxel_size or --max_landmarks!" << endl;
+        help = true;
+    }
+    if (voxel_size > 0 && max_landmarks > 0)
+        cerr << "Warning: --voxel_size overrides --max_landmarks" << endl;
+    // the mesh vertices are the landmarks, back-projected depth would be dropped
+    if (depth_voxel_size > 0 && !in_mesh.empty()) {
+        cerr << "--depth_landmarks can't be used with the landmarks of --in_mesh!" << endl;
+        help = true;
+    }
+
+    // views built from the video name frames that are never extracted, no stage can read their images
+    if (in_sfm.empty() && in_srgb.empty() && !in_video.empty() && (depth_upsample == "guided" || sample_colors)) {
+        cerr << "--depth_upsample guided and --sample_colors need the frames of --in_srgb or of the --in_sfm views!" << endl;
+        help = true;
+    }
+
+    // landmarks are observed from the views of --in_sfm or of the scan
+    if (!out_abc.empty() && in_sfm.empty() && (in_trajectory.empty() || (in_srgb.empty() && in_video.empty()))) {
+        cerr << "--out_abc needs the views of --in_sfm, or --in_traj with --in_srgb or --in_video!" << endl;
+        help = true;
+    }
+
+    // the sharpest frames replace the poses, the frames of the streams and of the views built from the video,
+    // image and frame folders stay the step-th frames
+    if (sharp_frames) {
+        if (in_video.empty()) {
+            cerr << "--sharp_frames needs --in_video!" << endl;
+            help = true;
+        }
+        if (!in_sfm.empty() || !in_srgb.empty()) {
+            cerr << "--sharp_frames can't be used with the view images of --in_sfm or --in_srgb!" << endl;
+            help = true;
+        }
+        if ((!in_exr.empty() && !utils::io::checkExtension(in_exr, ".zlib")) || !in_exr_abs.empty() ||
+            (!in_conf.empty() && !utils::io::checkExtension(in_conf, ".zlib"))) {
+            cerr << "--sharp_frames needs the .zlib depth and confidence streams instead of frame folders!" << endl;
+            help = true;
+        }
+    }
+
     if (args.size() > 1 || help) {
         cout << "Syntax: " << argv[0] << endl;
         cout << "Options:" << endl;
         cout << "   --in_abc <input>     Input file path to the meshroom alembic file" << endl;
         cout << "   --in_sfm <input>     Input file path to the meshroom camera sfm file" << endl;
         cout << "   --in_traj <input>    Input file path to the multiscan camera trajectory file" << endl;
-        cout << "   --in_exr <input>     Input folder path that stores the exr format depth images" << endl;
+        cout << "   --in_exr <input>     Input folder path that stores the exr format depth images, or the <scanID>.depth.zlib stream" << endl;
         cout << "   --in_exr_abs <input> Input folder path that stores the absolute exr format depth images" << endl;
         cout << "   --in_mesh <input>    Input file path to the PLY/OBJ mesh file" << endl;
         cout << "   --in_srgb <input>    Input folder path to sRGB images" << endl;
-        cout << "   --out_abc <output>   Output file path to the alembic file" << endl;
+        cout << "   --in_video <input>   Input <scanID>.mp4 decoded for --out_srgb, and for the views without --in_sfm and --in_srgb" << endl;
+        cout << "   --sharp_frames       Replace blurry frames of --in_video by the sharpest frame of their step window" << endl;
+        cout << "   --in_conf <input>    Input folder path to the ARKit confidence maps, or the <scanID>.confidence.zlib stream" << endl;
+        cout << "   --out_abc <output>   Output file path to the alembic file, or to a .sfm file with streamed landmarks" << endl;
         cout << "   --out_sfm <output>   Output file path to the meshroom camera sfm file" << endl;
         cout << "   --out_mesh <output>  Output file path to the PLY/OBJ mesh file" << endl;
         cout << "   --out_srgb <output>  Output folder path that stores the sRGB colorspace images" << endl;
         cout << "   --out_exr <output>   Output folder path that stores the exr format depth images" << endl;
         cout << "   --step <count>       Camera skipping step size argument for reading camera trajectories" << endl;
+        cout << "   --voxel_size <size>  Keep one mesh vertex per voxel of this size as landmark" << endl;
+        cout << "   --max_landmarks <n>  Fit the voxel size so that at most n landmarks are kept" << endl;
+        cout << "   --depth_landmarks <size>  Back-project the --in_exr depth into landmarks, one per voxel of this size" << endl;
+        cout << "   --min_confidence <level>  Mask depth pixels below this ARKit confidence level (0-2, default 1)" << endl;
+        cout << "   --sample_colors      Color landmarks and pick their views by luminance sampled from the frames" << endl;
+        cout << "   --cache_size <MB>    Memory budget of the decoded frame cache used by --sample_colors (default 2048)" << endl;
+        cout << "   --sample_downscale <n>  Downscale factor of the frames decoded by --sample_colors" << endl;
+        cout << "   --threads <n>        Number of frames converted concurrently by --out_exr (default: all cores)" << endl;
+        cout << "   --io_threads <n>     Number of threads reading and writing frames for --out_exr (default 2 each)" << endl;
+        cout << "   --depth_upsample <method>  Upsample sensor depth with bilinear or color guided interpolation (default bilinear)" << endl;
+        cout << "   --depth_source <source>  Write --out_exr from the sensor depth or render it from --in_mesh (default sensor)" << endl;
+        cout << "   --sim_maps           Also write Meshroom simMap files for --out_exr, from the ARKit confidence" << endl;
+        cout << "   --out_exr_filtered <output>  Output folder of the --out_exr depth maps filtered by multi-view consistency" << endl;
+        cout << "   --filter_neighbors <n>  Number of neighbor views the filtered depth is checked against (default 5)" << endl;
+        cout << "   --filter_min_views <n>  Number of consistent neighbor views needed to keep a depth value (default 2)" << endl;
+        cout << "   --out_tsdf <output>  Output file path to the PLY/OBJ mesh fused from the --in_exr depth frames" << endl;
+        cout << "   --tsdf_voxel_size <size>  Voxel size of the --out_tsdf fusion in meters (default 0.01)" << endl;
+        cout << "   --tsdf_budget <MB>   Memory budget of the --out_tsdf voxels (default 1024)" << endl;
+        cout << "   --depth_downscale <n>  Write depth maps at the color resolution divided by n, as Meshroom's downscale (default 1)" << endl;
+        cout << "   --depth_half         Store depth maps as half instead of full float" << endl;
+        cout << "   --exr_codec <name>   OpenEXR compression of the depth maps: none, rle, zips, zip, piz, pxr24, b44, b44a, dwaa, dwab (default piz)" << endl;
+        cout << "   --clean              Empty the --out_exr, --out_exr_filtered and --out_srgb folders instead of updating their stale frames" << endl;
         cout << "   -h, --help           Display this message" << endl;
         return -1;
     }
@@ -144,23 +407,77 @@ int main(int argc, char *argv[]) {
         sfmData::SfMData sfm_data;
 
         Converter converter;
+        converter.setThreads(num_threads);
+        converter.setIOThreads(io_threads);
+        converter.setConfidence(in_conf, min_confidence);
+        converter.setColorVideo(in_video);
+        converter.setSharpFrameSelection(sharp_frames);
+        converter.setWriteSimMaps(sim_maps);
+        converter.setCleanOutputs(clean);
+        converter.setDepthOutput(depth_downscale, depth_half, exr_codec);
+        converter.setDepthUpsampling(depth_upsample == "guided" ? Converter::DepthUpsampling::GUIDED
+                                                                : Converter::DepthUpsampling::BILINEAR);
 
-        if (!in_sfm.empty())
-            converter.importSFM(in_sfm);
+        if (!in_sfm.empty()) {
+            // load only the sfm parts the requested stages read
+            int parts = 0;
+            if (!out_abc.empty())
+                parts |= Converter::requiredParts(Converter::Stage::ABC);
+            if (!out_sfm.empty())
+                parts |= Converter::requiredParts(Converter::Stage::SFM);
+            if (!out_exr.empty() || !out_exr_filtered.empty())
+                parts |= Converter::requiredParts(Converter::Stage::DEPTH);
+            if (!out_mesh.empty())
+                parts |= Converter::requiredParts(Converter::Stage::MESH);
+            if (!out_srgb.empty())
+                parts |= Converter::requiredParts(Converter::Stage::SRGB);
+            converter.importSFM(in_sfm, sfmDataIO::ESfMData(parts));
+        }
         if (!in_trajectory.empty() && step > 0)
             converter.importCameras(in_trajectory, step);
+        // views from the extracted frames, or from the video frames without --in_srgb
+        if (in_sfm.empty() && !in_trajectory.empty() && (!in_srgb.empty() || !in_video.empty()) &&
+            (!out_sfm.empty() || !out_abc.empty() || !out_exr.empty() || !out_srgb.empty())) {
+            if (!converter.importScan(in_srgb))
+                return -1;
+        }
+        // the sharpest frames are selected while the video is decoded for --out_srgb, or in a pass of their own,
+        // before any stage reads the cameras
+        if (sharp_frames) {
+            if (!out_srgb.empty() && !converter.linearizeSRGB(in_srgb, out_srgb))
+                return -1;
+            if (!converter.selectSharpFrames())
+                return -1;
+        }
+        if (!out_tsdf.empty() && !converter.fuseDepth(in_exr, out_tsdf, tsdf_voxel_size, (size_t) tsdf_budget << 20))
+            return -1;
         if (!in_mesh.empty())
             converter.importMesh(in_mesh);
+        // rendered before the mesh is subsampled to landmarks
+        const bool mesh_depth = !out_exr.empty() && depth_source == "mesh";
+        if (mesh_depth && !converter.renderMeshDepth(out_exr))
+            return -1;
+        if (!in_mesh.empty() && (voxel_size > 0 || max_landmarks > 0))
+            converter.subsampleVertices(voxel_size, max_landmarks);
+        if (depth_voxel_size > 0) {
+            if (!converter.importDepthPoints(in_exr, depth_voxel_size))
+                return -1;
+        }
+        if (sample_colors)
+            converter.enableColorSampling((size_t) cache_size << 20, sample_downscale);
         if (!out_abc.empty())
             converter.exportABC(out_abc);
         if (!out_sfm.empty())
             converter.exportSFM(out_sfm);
-        if (!out_exr.empty())
-            converter.assignSensorDepth(in_srgb, in_exr, out_exr);
+        if (!out_exr.empty() && !mesh_depth && !converter.assignSensorDepth(in_exr, out_exr))
+            return -1;
+        if (!out_exr.empty() && !out_exr_filtered.empty() &&
+            !converter.filterDepthMaps(out_exr, out_exr_filtered, filter_neighbors, filter_min_views))
+            return -1;
         if (!out_mesh.empty())
             converter.exportMesh(out_mesh);
-        if (!out_srgb.empty())
-            converter.linearizeSRGB(in_srgb, out_srgb);
+        if (!out_srgb.empty() && !sharp_frames && !converter.linearizeSRGB(in_srgb, out_srgb))
+            return -1;
 
         return 0;
     } catch (const std::exception &e) {
@@ -0,0 +1,178 @@
+#include "mesh_raster.h"
+
+#include <cmath>
+#include <limits>
+
+#include <omp.h>
+
+using namespace std;
+
+namespace {
+    // triangles closer to the camera than this are skipped
+    const float near_depth = 0.01f;
+};
+
+MeshRasterizer::MeshRasterizer(const MatrixXf &positions, const MatrixXu &faces, int tile_size)
+    : _positions(positions), _faces(faces), _tile_size(std::max(tile_size, 8)) {}
+
+utils::depth::DepthStats MeshRasterizer::render(const Eigen::Matrix<float, 3, 4> &projection, int width, int height,
+                                                float max_depth, float *depth, int tile_threads) const {
+    const int num_vert = _positions.cols();
+    const int num_face = _faces.cols();
+    tile_threads = std::max(tile_threads, 1);
+
+    // vertices to pixels and depth
+    Eigen::Matrix<float, 3, Eigen::Dynamic> screen(3, num_vert);
+#pragma omp parallel for schedule(static) num_threads(tile_threads)
+    for (int v = 0; v < num_vert; ++v) {
+        const Eigen::Vector3f p = projection.leftCols<3>() * _positions.col(v) + projection.col(3);
+        screen.col(v) << p(0) / p(2), p(1) / p(2), p(2);
+    }
+
+    // triangle setup, faces outside the view or the depth range are dropped
+    vector<Triangle> triangles(num_face);
+    vector<uint8_t> visible(num_face, 0);
+#pragma omp parallel for schedule(static) num_threads(tile_threads)
+    for (int f = 0; f < num_face; ++f) {
+        Eigen::Vector3f v[3];
+        for (int k = 0; k < 3; ++k)
+            v[k] = screen.col(_faces(k, f));
+        if (v[0](2) < near_depth || v[1](2) < near_depth || v[2](2) < near_depth)
+            continue;
+        if (v[0](2) > max_depth && v[1](2) > max_depth && v[2](2) > max_depth)
+            continue;
+        // pixel x covers the center x + 0.5
+        Triangle &tri = triangles[f];
+        tri.x_min = std::max((int) ceil(std::min({v[0](0), v[1](0), v[2](0)}) - 0.5f), 0);
+        tri.x_max = std::min((int) floor(std::max({v[0](0), v[1](0), v[2](0)}) - 0.5f), width - 1);
+        tri.y_min = std::max((int) ceil(std::min({v[0](1), v[1](1), v[2](1)}) - 0.5f), 0);
+        tri.y_max = std::min((int) floor(std::max({v[0](1), v[1](1), v[2](1)}) - 0.5f), height - 1);
+        if (tri.x_min > tri.x_max || tri.y_min > tri.y_max)
+            continue;
+        // edge k is opposite of vertex k, a x + b y + c is its barycentric coordinate at pixel (x, y)
+        const float area = (v[1](0) - v[0](0)) * (v[2](1) - v[0](1)) - (v[1](1) - v[0](1)) * (v[2](0) - v[0](0));
+        if (fabs(area) < 1e-8f)
+            continue;
+        tri.inv_z_a = tri.inv_z_b = tri.inv_z_c = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            const Eigen::Vector3f &i = v[(k + 1) % 3];
+            const Eigen::Vector3f &j = v[(k + 2) % 3];
+            tri.edge_a[k] = (i(1) - j(1)) / area;
+            tri.edge_b[k] = (j(0) - i(0)) / area;
+            tri.edge_c[k] = (i(0) * j(1) - j(0) * i(1)) / area;
+            // the inverse depth is affine in screen space
+            tri.inv_z_a += tri.edge_a[k] / v[k](2);
+            tri.inv_z_b += tri.edge_b[k] / v[k](2);
+            tri.inv_z_c += tri.edge_c[k] / v[k](2);
+        }
+        visible[f] = 1;
+    }
+
+    // bin the triangles to the tiles they overlap, stored per tile from offsets[t] to offsets[t+1]
+    const int tiles_x = (width + _tile_size - 1) / _tile_size;
+    const int tiles_y = (height + _tile_size - 1) / _tile_size;
+    const int num_tile = tiles_x * tiles_y;
+    vector<size_t> offsets(num_tile + 1, 0);
+    for (int f = 0; f < num_face; ++f) {
+        if (!visible[f])
+            continue;
+        const Triangle &tri = triangles[f];
+        for (int ty = tri.y_min / _tile_size; ty <= tri.y_max / _tile_size; ++ty)
+            for (int tx = tri.x_min / _tile_size; tx <= tri.x_max / _tile_size; ++tx)
+                ++offsets[ty * tiles_x + tx + 1];
+    }
+    for (int t = 0; t < num_tile; ++t)
+        offsets[t + 1] += offsets[t];
+    vector<uint32_t> bins(offsets[num_tile]);
+    vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (int f = 0; f < num_face; ++f) {
+        if (!visible[f])
+            continue;
+        const Triangle &tri = triangles[f];
+        for (int ty = tri.y_min / _tile_size; ty <= tri.y_max / _tile_size; ++ty)
+            for (int tx = tri.x_min / _tile_size; tx <= tri.x_max / _tile_size; ++tx)
+                bins[fill[ty * tiles_x + tx]++] = f;
+    }
+
+    // every tile owns its pixels, the z-buffer holds inverse depth so that 0 is empty
+    vector<utils::depth::DepthStats> tile_stats(num_tile);
+#pragma omp parallel num_threads(tile_threads)
+    {
+        vector<float> inv_depth(_tile_size * _tile_size);
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < num_tile; ++t) {
+            const int x0 = (t % tiles_x) * _tile_size;
+            const int y0 = (t / tiles_x) * _tile_size;
+            const int x1 = std::min(x0 + _tile_size, width);
+            const int y1 = std::min(y0 + _tile_size, height);
+            rasterizeTile(triangles, bins.data() + offsets[t], offsets[t + 1] - offsets[t], x0, y0, x1, y1, inv_depth.data());
+
+            utils::depth::DepthStats &stats = tile_stats[t];
+            float min_depth = numeric_limits<float>::max();
+            float max_value = 0.0f;
+            for (int y = y0; y < y1; ++y) {
+                const float *src = inv_depth.data() + (y - y0) * _tile_size;
+                float *dst = depth + (size_t) y * width;
+                for (int x = x0; x < x1; ++x) {
+                    const float d = src[x - x0] > 0.0f ? 1.0f / src[x - x0] : -1.0f;
+                    if (d > 0.0f && d <= max_depth) {
+                        dst[x] = d;
+                        min_depth = std::min(min_depth, d);
+                        max_value = std::max(max_value, d);
+                        ++stats.valid_count;
+                    }
+                    else {
+                        dst[x] = -1.0f;
+                    }
+                }
+            }
+            if (stats.valid_count) {
+                stats.min_depth = min_depth;
+                stats.max_depth = max_value;
+            }
+        }
+    }
+
+    utils::depth::DepthStats stats;
+    stats.min_depth = numeric_limits<float>::max();
+    for (const utils::depth::DepthStats &tile : tile_stats) {
+        if (!tile.valid_count)
+            continue;
+        stats.min_depth = std::min(stats.min_depth, tile.min_depth);
+        stats.max_depth = std::max(stats.max_depth, tile.max_depth);
+        stats.valid_count += tile.valid_count;
+    }
+    if (!stats.valid_count)
+        stats.min_depth = 0.0f;
+    return stats;
+}
+
+void MeshRasterizer::rasterizeTile(const vector<Triangle> &triangles, const uint32_t *bin, size_t bin_size,
+                                   int x0, int y0, int x1, int y1, float *inv_depth) const {
+    std::fill(inv_depth, inv_depth + _tile_size * _tile_size, 0.0f);
+    for (size_t i = 0; i < bin_size; ++i) {
+        const Triangle &tri = triangles[bin[i]];
+        const int row_begin = std::max(tri.y_min, y0), row_end = std::min(tri.y_max + 1, y1);
+        const int col_begin = std::max(tri.x_min, x0), col_end = std::min(tri.x_max + 1, x1);
+        for (int y = row_begin; y < row_end; ++y) {
+            const float py = y + 0.5f;
+            // edge functions and inverse depth at the pixel x = 0 of the row, stepped along x
+            const float e0 = tri.edge_b[0] * py + tri.edge_c[0];
+            const float e1 = tri.edge_b[1] * py + tri.edge_c[1];
+            const float e2 = tri.edge_b[2] * py + tri.edge_c[2];
+            const float ez = tri.inv_z_b * py + tri.inv_z_c;
+            float *row = inv_depth + (y - y0) * _tile_size;
+            // branchless so that the compiler evaluates the edge functions of several pixels per instruction
+#pragma omp simd
+            for (int x = col_begin; x < col_end; ++x) {
+                const float px = x + 0.5f;
+                const float w0 = tri.edge_a[0] * px + e0;
+                const float w1 = tri.edge_a[1] * px + e1;
+                const float w2 = tri.edge_a[2] * px + e2;
+                const float z = tri.inv_z_a * px + ez;
+                const bool inside = w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f && z > row[x - x0];
+                row[x - x0] = inside ? z : row[x - x0];
+            }
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef MESH_RASTER_H
+#define MESH_RASTER_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <vector>
+
+#include "utils.h"
+#include <common.h>
+
+#include "depth_kernels.h"
+
+// Tile-binned CPU rasterizer rendering the depth of a triangle mesh seen by a camera. Triangles are set up
+// once per view, binned to square tiles of the image, and every tile is rasterized with its own z-buffer,
+// so tiles run in parallel without synchronization.
+class MeshRasterizer {
+public:
+    // The mesh is borrowed, positions 3 x N and faces 3 x F must outlive the rasterizer
+    MeshRasterizer(const MatrixXf &positions, const MatrixXu &faces, int tile_size = 32);
+
+    // Render the depth along the camera z axis of the world to pixel projection K [R|t] into a width x height
+    // map. Pixels hit by no triangle, or only beyond max_depth, are written as -1. Triangles reaching behind
+    // the near plane are skipped rather than clipped. Tiles are rasterized by tile_threads OpenMP threads.
+    utils::depth::DepthStats render(const Eigen::Matrix<float, 3, 4> &projection, int width, int height,
+                                    float max_depth, float *depth, int tile_threads = 1) const;
+
+private:
+    // edge functions scaled to barycentric coordinates and the inverse depth plane, in pixels
+    struct Triangle {
+        float edge_a[3], edge_b[3], edge_c[3];
+        float inv_z_a, inv_z_b, inv_z_c;
+        int x_min, x_max, y_min, y_max;
+    };
+
+    void rasterizeTile(const std::vector<Triangle> &triangles, const uint32_t *bin, size_t bin_size,
+                       int x0, int y0, int x1, int y1, float *inv_depth) const;
+
+    const MatrixXf &_positions;
+    const MatrixXu &_faces;
+    int _tile_size;
+};
+
+
+#endif //MESH_RASTER_H
@@ -1,9 +1,12 @@
 #include "obv_linker.h"
 
+#include <cstdlib>
 #include <ctime>
 #include <vector>
 #include <memory>
 
+#include <numeric>
+
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
@@ -20,7 +23,7 @@ ObvLinker::ObvLinker() = default;
 
 ObvLinker::~ObvLinker() = default;
 
-void ObvLinker::importCameras(const std::string& filepath, int step) {
+void ObvLinker::importCameras(const std::string& filepath, const FrameSampling& sampling) {
     std::clock_t start;
     double duration;
     start = std::clock();
@@ -31,17 +34,20 @@ void ObvLinker::importCameras(const std::string& filepath, int step) {
     vector<string> camera_array;
     boost::split(camera_array, f, boost::is_any_of("\n"));
     cout << camera_array.size() << endl;
-    int valid_camera_num = ceil(1.0*camera_array.size() / step);
+    int valid_camera_num = ceil(1.0*camera_array.size() / sampling.step);
 
     _intrinsics_array.resize(valid_camera_num, 9);
     _transform_array.resize(valid_camera_num, 16);
+    _exposure_array = VectorXf::Zero(valid_camera_num);
 
     Eigen::Vector4f tmp_vec;
     tmp_vec << 1.0, -1.0, -1.0, 1.0;
     auto coordinate_transform = tmp_vec.asDiagonal();
 
-    int cam_idx = 0;
-    for (int it=0; it < camera_array.size() && !camera_array[it].empty() && camera_array[it] != "\n"; it+=step) {
+    for (int cam_idx = 0; cam_idx < valid_camera_num; ++cam_idx) {
+        const size_t it = sampling.frameIndex(cam_idx);
+        if (it >= camera_array.size() || camera_array[it].empty() || camera_array[it] == "\n")
+            break;
         rapidjson::StringStream s(camera_array[it].c_str());
         rapidjson::Document d;
         d.ParseStream(s);
@@ -63,13 +69,68 @@ void ObvLinker::importCameras(const std::string& filepath, int step) {
         Eigen::Map<Eigen::VectorXf> valid_transform(transform_m.data(), transform_m.size());
 
         _transform_array.row(cam_idx) = valid_transform;
-        ++cam_idx;
+
+        if (d.HasMember("exposure_duration"))
+            _exposure_array(cam_idx) = d["exposure_duration"].GetFloat();
     }
 
     duration = (double)( std::clock() - start ) / (double) CLOCKS_PER_SEC;
     std::cout<<"timer: "<< duration <<'\n';
 }
 
+VectorXf ObvLinker::importFrameExposures(const std::string& filepath) const {
+    boost::iostreams::mapped_file mmap_file(filepath, boost::iostreams::mapped_file::readonly);
+    auto f = mmap_file.const_data();
+
+    vector<string> frame_array;
+    boost::split(frame_array, f, boost::is_any_of("\n"));
+    VectorXf exposures = VectorXf::Zero(frame_array.size());
+    const string key = "\"exposure_duration\"";
+    for (size_t it = 0; it < frame_array.size(); ++it) {
+        size_t pos = frame_array[it].find(key);
+        if (pos != string::npos)
+            pos = frame_array[it].find(':', pos + key.size());
+        if (pos != string::npos)
+            exposures(it) = strtof(frame_array[it].c_str() + pos + 1, nullptr);
+    }
+    return exposures;
+}
+
+bool ObvLinker::importMeta(const std::string& filepath) {
+    if (!utils::io::pathExists(filepath)) {
+        cout << "Error: Scan meta data " << filepath << " doesn't exist!" << endl;
+        return false;
+    }
+
+    boost::iostreams::mapped_file_source mmap_file(filepath);
+    rapidjson::Document d;
+    d.Parse(mmap_file.data(), mmap_file.size());
+    if (d.HasParseError() || !d.HasMember("streams") || !d["streams"].IsArray()) {
+        cout << "Error: Invalid scan meta data " << filepath << endl;
+        return false;
+    }
+
+    for (auto &stream : d["streams"].GetArray()) {
+        if (!stream.HasMember("type") || !stream.HasMember("resolution") || stream["resolution"].Size() != 2)
+            continue;
+        // ARKit frames are landscape, take the larger side as the width whatever the stored order
+        int a = stream["resolution"][0u].GetInt();
+        int b = stream["resolution"][1u].GetInt();
+        string type = stream["type"].GetString();
+        if (type == "color_camera") {
+            _image_width = std::max(a, b);
+            _image_height = std::min(a, b);
+        }
+        else if (type == "lidar_sensor") {
+            _depth_width = std::max(a, b);
+            _depth_height = std::min(a, b);
+        }
+    }
+    cout << "Color stream " << _image_width << "x" << _image_height << ", depth stream "
+         << _depth_width << "x" << _depth_height << endl;
+    return true;
+}
+
 void ObvLinker::importMesh(const string &filepath) {
     load_mesh_or_pointcloud(filepath, _faces, _positions, _normals, _colors, true);
 }
@@ -82,6 +143,190 @@ void ObvLinker::exportMesh(const string &filepath) {
     // write_mesh(filepath, _faces, _positions);
 }
 
+void ObvLinker::assignPoints(MatrixXf positions, vector<vector<int>> cameras, vector<vector<float>> scores) {
+    _positions = std::move(positions);
+    _associated_cameras = std::move(cameras);
+    _associated_scores = std::move(scores);
+    _faces.resize(3, 0);
+    _normals.resize(3, 0);
+    _colors.resize(3, 0);
+    _colormap.resize(0, 0);
+}
+
+Eigen::Matrix<float, 3, 4> ObvLinker::getProjection(int cam_idx) const {
+    Eigen::MatrixX4f intrinsics = Eigen::MatrixX4f::Zero(3, 4);
+    RowMatrixX9f::ConstRowXpr intrinsics_row = _intrinsics_array.row(cam_idx);
+    intrinsics.block<3,3>(0,0) = Eigen::Map<const Eigen::Matrix3f>(intrinsics_row.data(), 3, 3);
+    intrinsics = intrinsics / intrinsics(2, 2);
+    RowMatrixX16f::ConstRowXpr transform_row = _transform_array.row(cam_idx);
+    Eigen::Matrix4f transform = Eigen::Map<const Eigen::Matrix4f>(transform_row.data(), 4, 4);
+    transform = transform / transform(3, 3);
+    transform = transform.inverse().eval();
+    return intrinsics * transform;
+}
+
+Eigen::Vector3f ObvLinker::getViewDirection(int cam_idx) const {
+    // camera z axis in world coordinates, the third column of the camera pose rotation
+    RowMatrixX16f::ConstRowXpr transform_row = _transform_array.row(cam_idx);
+    return Eigen::Map<const Eigen::Matrix4f>(transform_row.data(), 4, 4).block<3, 1>(0, 2).normalized();
+}
+
+VectorXu ObvLinker::countObservations(const vector<uint8_t> &selected) const {
+    const int num_vert = _positions.cols();
+    const int num_cam = _transform_array.rows();
+    VectorXu count = VectorXu::Zero(num_vert);
+    if (!num_cam || !_intrinsics_array.size())
+        return count;
+
+    vector<Eigen::Matrix<float, 3, 4>> projections(num_cam);
+    vector<Eigen::Vector3f> directions(num_cam);
+    for (int it = 0; it < num_cam; ++it) {
+        projections[it] = getProjection(it);
+        directions[it] = getViewDirection(it);
+    }
+
+    const bool has_normals = _normals.cols() == num_vert;
+    const float w = _image_width;
+    const float h = _image_height;
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int p = 0; p < num_vert; ++p) {
+        if (!selected[p])
+            continue;
+        const Eigen::Vector3f point = _positions.col(p);
+        uint32_t visible = 0;
+        for (int it = 0; it < num_cam; ++it) {
+            if (has_normals && _normals.col(p).dot(directions[it]) >= 0.0f)
+                continue;
+            Eigen::Vector3f pixel = projections[it].leftCols<3>() * point + projections[it].col(3);
+            if (pixel(2) <= 0.0f)
+                continue;
+            float x = pixel(0) / pixel(2);
+            float y = pixel(1) / pixel(2);
+            if (x >= 0.0f && x < w && y >= 0.0f && y < h)
+                ++visible;
+        }
+        count(p) = visible;
+    }
+    return count;
+}
+
+vector<uint64_t> ObvLinker::computeVoxelKeys(const Eigen::Vector3f &origin, float voxel_size) const {
+    // 21 bits per axis, cells beyond that range are clamped to the border
+    const int64_t max_cell = (1 << 21) - 1;
+    const int num_vert = _positions.cols();
+    vector<uint64_t> keys(num_vert);
+#pragma omp parallel for schedule(static)
+    for (int p = 0; p < num_vert; ++p) {
+        Eigen::Vector3f cell = ((_positions.col(p) - origin) / voxel_size).array().floor();
+        uint64_t key = 0;
+        for (int d = 0; d < 3; ++d) {
+            int64_t c = std::min<int64_t>(std::max<int64_t>((int64_t) cell(d), 0), max_cell);
+            key |= (uint64_t) c << (21 * d);
+        }
+        keys[p] = key;
+    }
+    return keys;
+}
+
+int ObvLinker::countVoxels(const Eigen::Vector3f &origin, float voxel_size) const {
+    vector<uint64_t> keys = computeVoxelKeys(origin, voxel_size);
+    tbb::parallel_sort(keys.begin(), keys.end());
+    return std::unique(keys.begin(), keys.end()) - keys.begin();
+}
+
+void ObvLinker::subsampleVertices(float voxel_size, int max_vertices) {
+    if (!_positions.size()) {
+        cout << "Error: Empty position data!" << endl;
+        return;
+    }
+
+    const int num_vert = _positions.cols();
+    if (voxel_size <= 0 && (max_vertices <= 0 || max_vertices >= num_vert))
+        return;
+
+    Timer<> timer;
+    const Eigen::Vector3f origin = _positions.rowwise().minCoeff();
+    const Eigen::Vector3f extent = _positions.rowwise().maxCoeff() - origin;
+
+    if (voxel_size <= 0) {
+        // Mesh vertices lie on a surface, so the number of occupied voxels scales with
+        // the inverse square of the voxel size. Refine the estimate until it fits the budget.
+        voxel_size = std::max(extent.maxCoeff(), 1e-6f) / std::sqrt((float) max_vertices);
+        int voxel_num = countVoxels(origin, voxel_size);
+        for (int iter = 0; iter < 8 && (voxel_num > max_vertices || voxel_num < 0.9f * max_vertices); ++iter) {
+            voxel_size *= std::sqrt((float) voxel_num / (float) max_vertices);
+            voxel_num = countVoxels(origin, voxel_size);
+        }
+        while (voxel_num > max_vertices) {
+            voxel_size *= 1.05f;
+            voxel_num = countVoxels(origin, voxel_size);
+        }
+    }
+
+    const vector<uint64_t> keys = computeVoxelKeys(origin, voxel_size);
+    vector<uint32_t> order(num_vert);
+    iota(order.begin(), order.end(), 0);
+    tbb::parallel_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return keys[a] != keys[b] ? keys[a] < keys[b] : a < b;
+    });
+
+    // observations are only counted for vertices that share their voxel, a lone vertex is kept anyway
+    vector<size_t> voxel_begin;
+    vector<uint8_t> contested(num_vert, 0);
+    for (int i = 0; i < num_vert; ++i) {
+        if (i == 0 || keys[order[i]] != keys[order[i-1]])
+            voxel_begin.emplace_back(i);
+        else
+            contested[order[i]] = contested[order[i-1]] = 1;
+    }
+    voxel_begin.emplace_back(num_vert);
+    const VectorXu obv_count = countObservations(contested);
+
+    // per voxel, the vertex observed by the most cameras, then the closest to the voxel center
+    auto center_dist = [&](uint32_t p) {
+        Eigen::Vector3f cell = ((_positions.col(p) - origin) / voxel_size).array().floor();
+        return (_positions.col(p) - origin - (cell.array() + 0.5f).matrix() * voxel_size).squaredNorm();
+    };
+    const int voxel_num = voxel_begin.size() - 1;
+    vector<uint32_t> kept(voxel_num);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int v = 0; v < voxel_num; ++v) {
+        uint32_t best = order[voxel_begin[v]];
+        for (size_t i = voxel_begin[v] + 1; i < voxel_begin[v + 1]; ++i) {
+            const uint32_t p = order[i];
+            if (obv_count(p) > obv_count(best) || (obv_count(p) == obv_count(best) && center_dist(p) < center_dist(best)))
+                best = p;
+        }
+        kept[v] = best;
+    }
+    std::sort(kept.begin(), kept.end());
+
+    const int num_kept = kept.size();
+    MatrixXf positions(3, num_kept);
+    MatrixXf normals(_normals.rows(), _normals.cols() == num_vert ? num_kept : 0);
+    MatrixXu8 colors(_colors.rows(), _colors.cols() == num_vert ? num_kept : 0);
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_kept; ++i) {
+        positions.col(i) = _positions.col(kept[i]);
+        if (normals.cols())
+            normals.col(i) = _normals.col(kept[i]);
+        if (colors.cols())
+            colors.col(i) = _colors.col(kept[i]);
+    }
+    _positions = std::move(positions);
+    _normals = std::move(normals);
+    _colors = std::move(colors);
+
+    // faces would reference removed vertices, the mesh is no longer exported once subsampled
+    _faces.resize(3, 0);
+    _colormap.resize(0, 0);
+    _associated_cameras.clear();
+    _associated_scores.clear();
+
+    cout << "Subsampled " << num_vert << " vertices to " << num_kept << " with voxel size "
+         << voxel_size << " (took " << timeString(timer.value()) << ")" << endl;
+}
+
 void ObvLinker::linkVertices(sfmData::SfMData & sfm_data) {
     if (!_intrinsics_array.size() || !_transform_array.size()) {
         cout << "Error: Empty cameras, please import camera data before link vertices!" << endl;
@@ -97,56 +342,35 @@ void ObvLinker::linkVertices(sfmData::SfMData & sfm_data) {
     }
 
     const int num_cam = _intrinsics_array.rows();
-    Eigen::Matrix4Xf pos4(4, _positions.cols());
-    pos4 << _positions, Eigen::RowVectorXf::Ones(_positions.cols());
 
     _associated_cameras.resize(_positions.cols());
     _associated_scores.resize(_positions.cols());
     cout << _associated_cameras.size() << endl;
 
     for (int it = 0; it < num_cam; ++it) {
-        Eigen::MatrixX4f intrinsics = Eigen::MatrixX4f::Zero(3, 4);
-        intrinsics.block<3,3>(0,0) = Eigen::Map<Eigen::Matrix3f>(_intrinsics_array.row(it).data(), 3,3);
-        intrinsics = intrinsics / intrinsics(2, 2);
-        Eigen::MatrixX4f transform = Eigen::MatrixX4f::Zero(4, 4);
-        transform = Eigen::Map<Eigen::Matrix4f>(_transform_array.row(it).data(), 4, 4);
-        transform = transform / transform(3, 3);
-        transform = transform.inverse().eval();
-        Eigen::Matrix<float, 3, 4> project = intrinsics * transform;
-
-        Eigen::Vector3f camera_z = transform.row(2).head(3);
+        Eigen::Matrix<float, 3, 4> project = getProjection(it);
+
+        Eigen::Vector3f camera_z = getViewDirection(it);
         Eigen::VectorXf visibility_raw = _normals.transpose() * camera_z;
         Eigen::Array<bool, Eigen::Dynamic, 1> visibility = (visibility_raw.array() < 0.0).array();
 
         float margin = 0;
-        float w = 1920;
-        float h = 1440;
-        Eigen::Matrix2Xf pos2 = (project * pos4).colwise().hnormalized();
-        Eigen::Array<bool, Eigen::Dynamic, 1> x_in = (pos2.row(0).array() >= (0.0+margin)).array() * (pos2.row(0).array() < (1920-margin)).array();
-        Eigen::Array<bool, Eigen::Dynamic, 1> y_in = (pos2.row(1).array() >= (0.0+margin)).array() * (pos2.row(1).array() < (1440-margin)).array();
+        float w = _image_width;
+        float h = _image_height;
+        Eigen::Matrix3Xf pos3 = project.leftCols<3>() * _positions;
+        pos3.colwise() += project.col(3);
+        Eigen::Matrix2Xf pos2 = pos3.colwise().hnormalized();
+        Eigen::Array<bool, Eigen::Dynamic, 1> x_in = (pos2.row(0).array() >= (0.0+margin)).array() * (pos2.row(0).array() < (w-margin)).array();
+        Eigen::Array<bool, Eigen::Dynamic, 1> y_in = (pos2.row(1).array() >= (0.0+margin)).array() * (pos2.row(1).array() < (h-margin)).array();
         Eigen::Array<bool, Eigen::Dynamic, 1> in = x_in * y_in * visibility;
         cout << in.cast<int>().sum() << " visible points in camera " << it << endl;
 
-        sfmData::Views &views = sfm_data.getViews();
-
-        vector<IndexT> views_id(views.size());
-        for (auto &view_iter : views) {
-            int cam_idx = stoi(utils::io::getFileName(view_iter.second->getImagePath(), false));
-            views_id[cam_idx] = view_iter.second->getViewId();
-        }        
-
-        // image::Image<image::RGBfColor> image;
-        // string src_img = views.at(views_id[it])->getImagePath();
-        // readImage(src_img, image, image::EImageColorSpace::LINEAR);
-
         for (int p = 0; p < _positions.cols(); p++) {
             if (in(p)) {
                 _associated_cameras[p].emplace_back(it);
                 Eigen::Vector2f pixel = pos2.col(p);
                 float dist = (pixel(0)-w/2.0)*(pixel(0)-w/2.0) + (pixel(1)-h/2.0)*(pixel(1)-h/2.0);
                 dist = sqrt(dist);
-                // float luminance = float(image(pixel(1), pixel(0)));
-                // _associated_luminance[p].emplace_back(luminance);
                 _associated_scores[p].emplace_back(dist);
             }
         }
@@ -5,6 +5,7 @@
 #define EIGEN_MAX_STATIC_ALIGN_BYTES 0
 
 #include "utils.h"
+#include "frame_sampling.h"
 #include <meshio.h>
 
 #include <aliceVision/sfmData/SfMData.hpp>
@@ -17,24 +18,67 @@ class ObvLinker {
 public:
     ObvLinker();
     ~ObvLinker();
+    // bulk mesh and camera data is borrowed through const references or moved out, never copied
+    ObvLinker(const ObvLinker&) = delete;
+    ObvLinker& operator=(const ObvLinker&) = delete;
 
-    // parse ARKit camera poses & intrinsics
-    virtual void importCameras(const std::string& filepath, int step);
+    // parse ARKit camera poses & intrinsics of the sampled frames
+    virtual void importCameras(const std::string& filepath, const FrameSampling& sampling);
+    // exposure duration of every frame of the trajectory, 0 where it has none, without parsing the poses
+    VectorXf importFrameExposures(const std::string& filepath) const;
+    // parse color and depth stream resolutions from the ARKit scan meta data
+    virtual bool importMeta(const std::string& filepath);
     virtual void importMesh(const std::string& filepath);
     virtual void exportMesh(const std::string& filepath);
+    // Keep one best-observed vertex per voxel, either with a fixed voxel size or
+    // with a voxel size fitted to a target vertex budget
+    virtual void subsampleVertices(float voxel_size, int max_vertices);
     // Assign visibility to mesh vertices
     void linkVertices(sfmData::SfMData & sfm_data);
     inline int getVertNum() const { return _positions.cols(); }
 
     inline const MatrixXf& getPositions() const { return _positions; };
+    inline const MatrixXu& getFaces() const { return _faces; };
     inline const RowMatrixX16f& getTransformArray() const { return _transform_array; };
     inline const RowMatrixX9f& getIntrinsicsArray() const { return _intrinsics_array; };
+    inline const VectorXf& getExposureArray() const { return _exposure_array; };
+    inline int getImageWidth() const { return _image_width; }
+    inline int getImageHeight() const { return _image_height; }
+    inline int getDepthWidth() const { return _depth_width; }
+    inline int getDepthHeight() const { return _depth_height; }
     inline const std::vector<std::vector<int>>& getAssociatedCameras() const { return _associated_cameras; }
     inline const std::vector<std::vector<float>>& getAssociatedScores() const { return _associated_scores; }
+    // hand the visibility over to the caller, leaving the linker's copy empty
+    inline std::vector<std::vector<int>> releaseAssociatedCameras() {
+        std::vector<std::vector<int>> cameras;
+        cameras.swap(_associated_cameras);
+        return cameras;
+    }
+    inline std::vector<std::vector<float>> releaseAssociatedScores() {
+        std::vector<std::vector<float>> scores;
+        scores.swap(_associated_scores);
+        return scores;
+    }
 
-    inline void assignColorMap(MatrixXf &colormap) { _colormap = colormap; }
+    inline void assignColorMap(MatrixXf colormap) { _colormap = std::move(colormap); }
+    // projection of world points to the color image pixels of a camera
+    Eigen::Matrix<float, 3, 4> getProjection(int cam_idx) const;
+    // Replace the mesh with a point set whose visibility is already known, e.g. back-projected sensor depth
+    void assignPoints(MatrixXf positions, std::vector<std::vector<int>> cameras, std::vector<std::vector<float>> scores);
+    inline bool hasVisibility() const { return _positions.cols() && _associated_cameras.size() == (size_t) _positions.cols(); }
 
 private:
+    Eigen::Vector3f getViewDirection(int cam_idx) const;
+    // number of cameras seeing each selected vertex, 0 for the others
+    VectorXu countObservations(const std::vector<uint8_t> &selected) const;
+    std::vector<uint64_t> computeVoxelKeys(const Eigen::Vector3f &origin, float voxel_size) const;
+    int countVoxels(const Eigen::Vector3f &origin, float voxel_size) const;
+
+    int _image_width = 1920;
+    int _image_height = 1440;
+    int _depth_width = 256;
+    int _depth_height = 192;
+
     MatrixXu _faces;
     MatrixXf _positions;
     MatrixXf _normals;
@@ -42,6 +86,7 @@ private:
     MatrixXu8 _colors;
     RowMatrixX9f _intrinsics_array;
     RowMatrixX16f _transform_array;
+    VectorXf _exposure_array;
     std::vector<std::vector<int>> _associated_cameras;
     std::vector<std::vector<float>> _associated_scores;
 };
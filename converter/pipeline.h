@@ -0,0 +1,357 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alloc_counter.h"
+
+namespace utils {
+namespace pipeline {
+    // Bounded lock-free multi-producer multi-consumer queue (Vyukov's ring of sequenced cells).
+    // The blocking push and pop spin briefly, then sleep on a condition variable until the other side moves,
+    // so that idle pipeline threads leave their cores to the busy ones.
+    template <typename T>
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity)
+                size <<= 1;
+            _mask = size - 1;
+            _cells.reset(new Cell[size]);
+            for (size_t i = 0; i < size; ++i)
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        // Move value into the queue, false if it is full
+        bool tryPush(T &value) {
+            if (!pushCell(value))
+                return false;
+            wake();
+            return true;
+        }
+
+        // Move the oldest value out of the queue, false if it is empty
+        bool tryPop(T &value) {
+            if (!popCell(value))
+                return false;
+            wake();
+            return true;
+        }
+
+        // Push, waiting while the queue is full
+        void push(T &value) {
+            for (int spin = 0; !tryPush(value); ++spin) {
+                if (spin < spin_count) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                bool suc;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    ++_waiters;
+                    suc = pushCell(value);
+                    if (!suc)
+                        _cond.wait_for(lock, std::chrono::milliseconds(10));
+                    --_waiters;
+                }
+                if (suc) {
+                    wake();
+                    return;
+                }
+            }
+        }
+
+        // Pop, waiting while the queue is empty; false once the queue is closed and drained
+        bool pop(T &value) {
+            for (int spin = 0;; ++spin) {
+                if (tryPop(value))
+                    return true;
+                if (_closed.load(std::memory_order_acquire))
+                    return tryPop(value);
+                if (spin < spin_count) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                bool suc;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    ++_waiters;
+                    suc = popCell(value);
+                    if (!suc && !_closed.load(std::memory_order_acquire))
+                        _cond.wait_for(lock, std::chrono::milliseconds(10));
+                    --_waiters;
+                }
+                if (suc) {
+                    wake();
+                    return true;
+                }
+            }
+        }
+
+        // No more values will be pushed
+        void close() {
+            _closed.store(true, std::memory_order_release);
+            std::lock_guard<std::mutex> lock(_mutex);
+            _cond.notify_all();
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Cell[]> _cells;
+        size_t _mask;
+        alignas(64) std::atomic<size_t> _head{0};
+        alignas(64) std::atomic<size_t> _tail{0};
+        std::atomic<bool> _closed{false};
+
+        // a waiter registers under the mutex before its last try, so a wake after that try finds it waiting;
+        // the timed wait covers a wake racing the registration
+        static const int spin_count = 64;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::atomic<int> _waiters{0};
+
+        // lock-free cell operations, without waking waiters
+        bool pushCell(T &value) {
+            size_t pos = _tail.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell &cell = _cells[pos & _mask];
+                const size_t seq = cell.sequence.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+                if (diff == 0) {
+                    if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        cell.value = std::move(value);
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;
+                }
+                else {
+                    pos = _tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool popCell(T &value) {
+            size_t pos = _head.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell &cell = _cells[pos & _mask];
+                const size_t seq = cell.sequence.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+                if (diff == 0) {
+                    if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        value = std::move(cell.value);
+                        cell.sequence.store(pos + _mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;
+                }
+                else {
+                    pos = _head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        void wake() {
+            if (_waiters.load() > 0) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _cond.notify_all();
+            }
+        }
+    };
+
+    // Throughput counters of one pipeline stage
+    struct StageStats {
+        std::atomic<size_t> items{0};
+        std::atomic<size_t> failed{0};
+        std::atomic<int64_t> busy_us{0};
+        std::atomic<int64_t> wait_us{0};
+        // heap allocations made inside the stage, counted when COUNT_ALLOCATIONS is on
+        std::atomic<size_t> allocations{0};
+        std::atomic<size_t> allocated_bytes{0};
+    };
+
+    // Three-stage frame pipeline: frames [0, count) are read, transformed and written by separate
+    // thread groups connected through bounded queues, so that I/O of some frames overlaps the processing
+    // of others. At most queue_capacity frames wait between two stages, which bounds the memory in flight.
+    // A stage returning false drops the frame. Frame needs an int index member, set before reading.
+    // Frames are recycled once written or dropped, with the buffers they hold, so that in steady state no frame
+    // memory is allocated: stages must overwrite every member they read, instead of expecting a new frame.
+    template <typename Frame>
+    class FramePipeline {
+    public:
+        typedef std::function<bool(int, Frame&)> Stage;
+        typedef std::function<void(Frame&)> Init;
+
+        explicit FramePipeline(size_t queue_capacity)
+            : _queue_capacity(queue_capacity), _transform_queue(queue_capacity), _write_queue(queue_capacity) {}
+
+        // Size the buffers of a new frame before it is first read, e.g. to the scan resolution
+        inline void setFrameInit(Init init) { _init = init; }
+
+        // Number of frames written
+        size_t run(int count, Stage read, int read_threads, Stage transform, int transform_threads,
+                   Stage write, int write_threads) {
+            typedef std::chrono::steady_clock clock;
+            auto elapsed_us = [](clock::time_point start) {
+                return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+            };
+            const clock::time_point start = clock::now();
+
+            // frames are made on demand and returned to the pool, which holds at most as many as can be in flight:
+            // the queued ones and one per thread
+            BoundedQueue<std::unique_ptr<Frame>> pool(2 * _queue_capacity + read_threads + transform_threads + write_threads);
+            _pool_frames = 0;
+            auto recycle = [&](std::unique_ptr<Frame> &frame) {
+                if (!pool.tryPush(frame))
+                    frame.reset();
+            };
+            // allocations of the calling thread during a stage
+            auto counted = [](StageStats &stats, const std::function<bool()> &stage) {
+                const alloc::Stats start = alloc::currentThread();
+                const bool suc = stage();
+                const alloc::Stats end = alloc::currentThread();
+                stats.allocations += end.count - start.count;
+                stats.allocated_bytes += end.bytes - start.bytes;
+                return suc;
+            };
+
+            std::atomic<int> next_frame(0);
+            std::atomic<int> readers(read_threads), transformers(transform_threads);
+            std::vector<std::thread> threads;
+
+            for (int t = 0; t < read_threads; ++t) {
+                threads.emplace_back([&]() {
+                    for (int idx = next_frame++; idx < count; idx = next_frame++) {
+                        std::unique_ptr<Frame> frame;
+                        if (!pool.tryPop(frame)) {
+                            frame.reset(new Frame());
+                            if (_init)
+                                _init(*frame);
+                            ++_pool_frames;
+                        }
+                        frame->index = idx;
+                        clock::time_point busy = clock::now();
+                        const bool suc = counted(_stats[0], [&]() { return read(idx, *frame); });
+                        _stats[0].busy_us += elapsed_us(busy);
+                        if (!suc) {
+                            ++_stats[0].failed;
+                            recycle(frame);
+                            continue;
+                        }
+                        ++_stats[0].items;
+                        clock::time_point wait = clock::now();
+                        _transform_queue.push(frame);
+                        _stats[0].wait_us += elapsed_us(wait);
+                    }
+                    if (--readers == 0)
+                        _transform_queue.close();
+                });
+            }
+            for (int t = 0; t < transform_threads; ++t) {
+                threads.emplace_back([&]() {
+                    std::unique_ptr<Frame> frame;
+                    clock::time_point wait = clock::now();
+                    while (_transform_queue.pop(frame)) {
+                        _stats[1].wait_us += elapsed_us(wait);
+                        clock::time_point busy = clock::now();
+                        const bool suc = counted(_stats[1], [&]() { return transform(frame->index, *frame); });
+                        _stats[1].busy_us += elapsed_us(busy);
+                        wait = clock::now();
+                        if (!suc) {
+                            ++_stats[1].failed;
+                            recycle(frame);
+                            continue;
+                        }
+                        ++_stats[1].items;
+                        _write_queue.push(frame);
+                    }
+                    if (--transformers == 0)
+                        _write_queue.close();
+                });
+            }
+            for (int t = 0; t < write_threads; ++t) {
+                threads.emplace_back([&]() {
+                    std::unique_ptr<Frame> frame;
+                    clock::time_point wait = clock::now();
+                    while (_write_queue.pop(frame)) {
+                        _stats[2].wait_us += elapsed_us(wait);
+                        clock::time_point busy = clock::now();
+                        const bool suc = counted(_stats[2], [&]() { return write(frame->index, *frame); });
+                        _stats[2].busy_us += elapsed_us(busy);
+                        recycle(frame);
+                        wait = clock::now();
+                        if (suc)
+                            ++_stats[2].items;
+                        else
+                            ++_stats[2].failed;
+                    }
+                });
+            }
+            for (std::thread &thread : threads)
+                thread.join();
+
+            _elapsed_us = elapsed_us(start);
+            return _stats[2].items;
+        }
+
+        const StageStats& getStats(int stage) const { return _stats[stage]; }
+
+        // Frames per second of every stage, over the time its threads were busy and over the wall time
+        void printStats(std::ostream &out = std::cout) const {
+            const char *names[] = {"read", "transform", "write"};
+            out << std::fixed << std::setprecision(1);
+            for (int s = 0; s < 3; ++s) {
+                const double busy = _stats[s].busy_us * 1e-6;
+                const double wait = _stats[s].wait_us * 1e-6;
+                out << "    " << std::setw(9) << names[s] << ": " << _stats[s].items << " frames, "
+                    << _stats[s].failed << " failed, busy " << busy << "s, waiting " << wait << "s, "
+                    << (_elapsed_us ? _stats[s].items * 1e6 / _elapsed_us : 0.0) << " frames/s" << std::endl;
+            }
+            out.unsetf(std::ios_base::floatfield);
+            if (alloc::enabled()) {
+                out << "    " << _pool_frames << " frames allocated" << std::endl;
+                for (int s = 0; s < 3; ++s) {
+                    const size_t frames = std::max<size_t>(_stats[s].items + _stats[s].failed, 1);
+                    out << "    " << std::setw(9) << names[s] << ": " << _stats[s].allocations / frames
+                        << " allocations, " << _stats[s].allocated_bytes / frames << " bytes per frame" << std::endl;
+                }
+            }
+        }
+
+    private:
+        size_t _queue_capacity;
+        Init _init;
+        // frames made by the last run
+        std::atomic<size_t> _pool_frames{0};
+        BoundedQueue<std::unique_ptr<Frame>> _transform_queue;
+        BoundedQueue<std::unique_ptr<Frame>> _write_queue;
+        StageStats _stats[3];
+        int64_t _elapsed_us = 0;
+    };
+};
+};
+
+
+#endif //PIPELINE_H
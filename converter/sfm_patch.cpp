@@ -0,0 +1,304 @@
+#include "sfm_patch.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <rapidjson/reader.h>
+#include <rapidjson/memorystream.h>
+
+#include "sfm_writer.h"
+
+namespace fs = std::experimental::filesystem;
+using namespace std;
+
+namespace {
+    struct ByteRange {
+        size_t begin = 0;
+        size_t end = 0;
+        size_t count = 0;
+        bool is_array = false;
+        inline bool valid() const { return end > begin; }
+    };
+
+    struct SfMView {
+        string view_id, pose_id, intrinsic_id, path;
+    };
+
+    struct SfMIntrinsic {
+        string intrinsic_id;
+        ByteRange focal, principal_point, distortion;
+    };
+
+    // Records the byte ranges of the parts of a Meshroom .sfm file that are patched,
+    // along with the view ids needed to build the poses
+    class SfMRangeHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, SfMRangeHandler> {
+    public:
+        explicit SfMRangeHandler(const rapidjson::MemoryStream &stream) : _stream(stream) {}
+
+        bool StartObject() {
+            if (_depth == 2 && _top_key == "views")
+                views.emplace_back();
+            else if (_depth == 2 && _top_key == "intrinsics")
+                intrinsics.emplace_back();
+            ++_depth;
+            return true;
+        }
+
+        bool EndObject(rapidjson::SizeType) {
+            --_depth;
+            if (_depth == 0)
+                document_end = _stream.Tell() - 1;
+            return true;
+        }
+
+        bool StartArray() {
+            const size_t begin = _stream.Tell() - 1;
+            if (_depth == 1)
+                top_ranges[_top_key].begin = begin;
+            else if (ByteRange *range = memberRange())
+                range->begin = begin;
+            ++_depth;
+            return true;
+        }
+
+        bool EndArray(rapidjson::SizeType count) {
+            --_depth;
+            const size_t end = _stream.Tell();
+            if (_depth == 1) {
+                top_ranges[_top_key].end = end;
+            }
+            else if (ByteRange *range = memberRange()) {
+                range->end = end;
+                range->count = count;
+                range->is_array = true;
+            }
+            return true;
+        }
+
+        bool Key(const char *str, rapidjson::SizeType length, bool) {
+            if (_depth == 1)
+                _top_key.assign(str, length);
+            else if (_depth == 3)
+                _member_key.assign(str, length);
+            return true;
+        }
+
+        bool String(const char *str, rapidjson::SizeType length, bool) {
+            return value(string(str, length), true);
+        }
+
+        bool Int(int value) { return this->value(to_string(value), false); }
+        bool Uint(unsigned value) { return this->value(to_string(value), false); }
+        bool Int64(int64_t value) { return this->value(to_string(value), false); }
+        bool Uint64(uint64_t value) { return this->value(to_string(value), false); }
+        bool Double(double value) { return this->value(to_string(value), false); }
+
+        bool Default() { return true; }
+
+        std::vector<SfMView> views;
+        std::vector<SfMIntrinsic> intrinsics;
+        std::map<std::string, ByteRange> top_ranges;
+        size_t document_end = 0;
+
+    private:
+        bool value(const string &str, bool quoted) {
+            if (_depth != 3)
+                return true;
+            if (_top_key == "views" && !views.empty()) {
+                SfMView &view = views.back();
+                if (_member_key == "viewId")
+                    view.view_id = str;
+                else if (_member_key == "poseId")
+                    view.pose_id = str;
+                else if (_member_key == "intrinsicId")
+                    view.intrinsic_id = str;
+                else if (_member_key == "path")
+                    view.path = str;
+            }
+            else if (_top_key == "intrinsics" && !intrinsics.empty()) {
+                if (_member_key == "intrinsicId")
+                    intrinsics.back().intrinsic_id = str;
+                else if (ByteRange *range = memberRange()) {
+                    // number strings have no escapes, so a quoted value spans its length plus the two quotes
+                    // before the stream position; a number may be written differently than it is parsed, so
+                    // its text is found back to the separator before it
+                    range->end = _stream.Tell();
+                    range->begin = quoted ? range->end - str.size() - 2 : tokenBegin(range->end);
+                }
+            }
+            return true;
+        }
+
+        size_t tokenBegin(size_t end) const {
+            size_t begin = end;
+            while (begin > 0 && !strchr(":,[ \t\r\n", _stream.begin_[begin - 1]))
+                --begin;
+            return begin;
+        }
+
+        ByteRange *memberRange() {
+            if (_depth != 3 || _top_key != "intrinsics" || intrinsics.empty())
+                return nullptr;
+            SfMIntrinsic &intrinsic = intrinsics.back();
+            if (_member_key == "pxFocalLength")
+                return &intrinsic.focal;
+            if (_member_key == "principalPoint")
+                return &intrinsic.principal_point;
+            if (_member_key == "distortionParams")
+                return &intrinsic.distortion;
+            return nullptr;
+        }
+
+        const rapidjson::MemoryStream &_stream;
+        int _depth = 0;
+        string _top_key;
+        string _member_key;
+    };
+
+    struct Replacement {
+        size_t begin, end;
+        string text;
+        bool operator<(const Replacement &other) const { return begin < other.begin; }
+    };
+
+    string formatArray(const vector<double> &values, const string &indent) {
+        string out = "[";
+        for (size_t i = 0; i < values.size(); ++i) {
+            out.append(i ? ",\n" : "\n");
+            out.append(indent + "    ");
+            utils::json::appendNumber(out, values[i]);
+        }
+        out.append("\n" + indent + "]");
+        return out;
+    }
+};
+
+bool patchKnownPoses(const string &in_sfm, const string &out_sfm,
+                     const RowMatrixX9f &intrinsics_array, const RowMatrixX16f &transform_array) {
+    if (!utils::io::pathExists(in_sfm) || !intrinsics_array.rows() || !transform_array.rows())
+        return false;
+
+    boost::iostreams::mapped_file_source mmap_file(in_sfm);
+    const char *data = mmap_file.data();
+    const size_t size = mmap_file.size();
+
+    rapidjson::MemoryStream stream(data, size);
+    SfMRangeHandler handler(stream);
+    rapidjson::Reader reader;
+    if (reader.Parse(stream, handler).IsError() || handler.views.empty()) {
+        cerr << "Unable to parse the views of " << in_sfm << endl;
+        return false;
+    }
+
+    // views by camera index, the image file name is the index of the camera in the trajectory
+    map<int, const SfMView*> camera_views;
+    for (const SfMView &view : handler.views)
+        camera_views[stoi(fs::path(view.path).stem().string())] = &view;
+    if (!camera_views.count(0) || camera_views.rbegin()->first >= transform_array.rows()) {
+        cerr << "Views of " << in_sfm << " do not match the camera trajectory" << endl;
+        return false;
+    }
+
+    vector<Replacement> replacements;
+
+    // poses of all views, ordered by pose id like sfmData::Poses
+    map<uint64_t, string> poses;
+    for (const auto &camera_view : camera_views) {
+        Eigen::VectorXf transform = transform_array.row(camera_view.first);
+        Eigen::Map<Eigen::Matrix4f> transform_m(transform.data(), 4, 4);
+        // camera pose to camera extrinsics
+        transform_m = transform_m.inverse().eval();
+        const Eigen::Matrix3d rotation = transform_m.block<3, 3>(0, 0).cast<double>();
+        const Eigen::Vector3d center = -rotation.transpose() * transform_m.block<3, 1>(0, 3).cast<double>();
+
+        string pose = "        {\n            \"poseId\": ";
+        pose.append("\"" + camera_view.second->pose_id + "\"");
+        pose.append(",\n            \"pose\": {\n                \"transform\": {\n                    \"rotation\": ");
+        pose.append(formatArray(vector<double>(rotation.data(), rotation.data() + 9), "                    "));
+        pose.append(",\n                    \"center\": ");
+        pose.append(formatArray(vector<double>(center.data(), center.data() + 3), "                    "));
+        pose.append("\n                },\n                \"locked\": \"1\"\n            }\n        }");
+        poses[stoull(camera_view.second->pose_id)] = pose;
+    }
+    string poses_text = "[";
+    for (auto it = poses.begin(); it != poses.end(); ++it)
+        poses_text.append((it == poses.begin() ? "\n" : ",\n") + it->second);
+    poses_text.append("\n    ]");
+
+    auto poses_range = handler.top_ranges.find("poses");
+    if (poses_range != handler.top_ranges.end() && poses_range->second.valid()) {
+        replacements.push_back({poses_range->second.begin, poses_range->second.end, poses_text});
+    }
+    else {
+        size_t insert = handler.document_end;
+        while (insert > 0 && isspace(data[insert - 1]))
+            --insert;
+        replacements.push_back({insert, insert, ",\n    \"poses\": " + poses_text});
+    }
+
+    // features and matches are extracted again with known poses
+    const char *folders[] = {"featuresFolders", "matchesFolders"};
+    for (const char *key : folders) {
+        auto range = handler.top_ranges.find(key);
+        if (range != handler.top_ranges.end() && range->second.valid())
+            replacements.push_back({range->second.begin, range->second.end, "[]"});
+    }
+
+    // intrinsic of the first camera, as updated by linkKnownPoses
+    const string &intrinsic_id = camera_views[0]->intrinsic_id;
+    auto intrinsic = find_if(handler.intrinsics.begin(), handler.intrinsics.end(),
+                             [&](const SfMIntrinsic &i) { return i.intrinsic_id == intrinsic_id; });
+    if (intrinsic == handler.intrinsics.end() || !intrinsic->focal.valid() || !intrinsic->principal_point.valid()) {
+        cerr << "Intrinsic " << intrinsic_id << " not found in " << in_sfm << endl;
+        return false;
+    }
+    const double focal = intrinsics_array(0, 0);
+    const string indent = "            ";
+    if (intrinsic->focal.is_array) {
+        replacements.push_back({intrinsic->focal.begin, intrinsic->focal.end,
+                                formatArray(vector<double>(intrinsic->focal.count, focal), indent)});
+    }
+    else {
+        string text;
+        utils::json::appendNumber(text, focal);
+        replacements.push_back({intrinsic->focal.begin, intrinsic->focal.end, text});
+    }
+    replacements.push_back({intrinsic->principal_point.begin, intrinsic->principal_point.end,
+                            formatArray({intrinsics_array(0, 6), intrinsics_array(0, 7)}, indent)});
+    if (intrinsic->distortion.valid()) {
+        replacements.push_back({intrinsic->distortion.begin, intrinsic->distortion.end,
+                                formatArray(vector<double>(intrinsic->distortion.count, 0.0), indent)});
+    }
+
+    // splice the replacements into the verbatim input, through a temporary file so that
+    // the input can be patched in place
+    sort(replacements.begin(), replacements.end());
+    const string tmp_path = out_sfm + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        cerr << "Unable to open " << tmp_path << " for writing!" << endl;
+        return false;
+    }
+    bool suc = true;
+    size_t offset = 0;
+    for (const Replacement &replacement : replacements) {
+        suc = suc && fwrite(data + offset, 1, replacement.begin - offset, file) == replacement.begin - offset;
+        suc = suc && fwrite(replacement.text.data(), 1, replacement.text.size(), file) == replacement.text.size();
+        offset = replacement.end;
+    }
+    suc = suc && fwrite(data + offset, 1, size - offset, file) == size - offset;
+    suc = (fclose(file) == 0) && suc;
+    mmap_file.close();
+
+    if (!suc) {
+        fs::remove(tmp_path);
+        return false;
+    }
+    fs::rename(tmp_path, out_sfm);
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef SFM_PATCH_H
+#define SFM_PATCH_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <string>
+
+#include "utils.h"
+
+// Assign ARKit poses and intrinsics to an existing Meshroom .sfm file without loading it.
+// The input is parsed once with a SAX pass; the poses array, the focal length, principal point
+// and distortion of the first camera's intrinsic, and the features/matches folders are replaced,
+// every other byte of the input is copied verbatim to the output.
+bool patchKnownPoses(const std::string& in_sfm, const std::string& out_sfm,
+                     const RowMatrixX9f& intrinsics_array, const RowMatrixX16f& transform_array);
+
+
+#endif //SFM_PATCH_H
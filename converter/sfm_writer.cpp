@@ -0,0 +1,192 @@
+#include "sfm_writer.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <aliceVision/sfmDataIO/sfmDataIO.hpp>
+
+#include "utils.h"
+
+namespace fs = std::experimental::filesystem;
+using namespace std;
+
+namespace utils {
+namespace json {
+    static inline void appendDigits(string &out, uint64_t value) {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = char('0' + value % 10);
+            value /= 10;
+        } while (value);
+        while (n)
+            out.push_back(digits[--n]);
+    }
+
+    void appendIndex(string &out, uint64_t value) {
+        out.push_back('"');
+        appendDigits(out, value);
+        out.push_back('"');
+    }
+
+    void appendRawNumber(string &out, double value) {
+        const double scale = 1e9;
+        if (!std::isfinite(value) || fabs(value) >= 1e9) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.17g", value);
+            out.append(buf);
+            return;
+        }
+
+        uint64_t scaled = (uint64_t) llround(fabs(value) * scale);
+        if (value < 0 && scaled)
+            out.push_back('-');
+        appendDigits(out, scaled / (uint64_t) scale);
+        uint64_t frac = scaled % (uint64_t) scale;
+        if (frac) {
+            char digits[9];
+            for (int i = 8; i >= 0; --i) {
+                digits[i] = char('0' + frac % 10);
+                frac /= 10;
+            }
+            int n = 9;
+            while (digits[n-1] == '0')
+                --n;
+            out.push_back('.');
+            out.append(digits, n);
+        }
+    }
+
+    void appendNumber(string &out, double value) {
+        out.push_back('"');
+        appendRawNumber(out, value);
+        out.push_back('"');
+    }
+};
+};
+
+SfMStreamWriter::SfMStreamWriter(const string &filepath, size_t buffer_size)
+    : _filepath(filepath), _buffer_size(buffer_size) {
+    _file = fopen(filepath.c_str(), "wb");
+    if (!_file)
+        cerr << "Unable to open " << filepath << " for writing!" << endl;
+    _buffer.reserve(_buffer_size);
+}
+
+SfMStreamWriter::~SfMStreamWriter() {
+    if (_file)
+        fclose(_file);
+}
+
+bool SfMStreamWriter::writeHeader(const sfmData::SfMData &sfm_data) {
+    if (!_file)
+        return false;
+
+    // views, intrinsics and poses are small, serialize them with AliceVision and
+    // splice the structure array in before the closing brace of the document
+    fs::path header_path = fs::path(_filepath).parent_path() / ("." + fs::path(_filepath).stem().string() + ".header.sfm");
+    const sfmDataIO::ESfMData parts = sfmDataIO::ESfMData(sfmDataIO::VIEWS | sfmDataIO::INTRINSICS | sfmDataIO::EXTRINSICS);
+    if (!sfmDataIO::Save(sfm_data, header_path.string(), parts)) {
+        cerr << "Unable to write the sfm header to " << header_path.string() << endl;
+        return false;
+    }
+
+    string header;
+    {
+        ifstream ifs(header_path.string(), ios::binary);
+        stringstream ss;
+        ss << ifs.rdbuf();
+        header = ss.str();
+    }
+    fs::remove(header_path);
+
+    size_t end = header.find_last_of('}');
+    if (end == string::npos)
+        return false;
+    header.resize(end);
+    while (!header.empty() && isspace(header.back()))
+        header.pop_back();
+
+    header.append(",\n    \"structure\": [");
+    return write(header.data(), header.size());
+}
+
+void SfMStreamWriter::formatLandmark(string &chunk, IndexT landmark_id, const Vec3 &X, const image::RGBColor &color,
+                                     const vector<pair<IndexT, Vec2>> &observations) const {
+    using namespace utils::json;
+
+    chunk.append(",\n        {\n            \"landmarkId\": ");
+    appendIndex(chunk, landmark_id);
+    chunk.append(",\n            \"descType\": \"");
+    chunk.append(feature::EImageDescriberType_enumToString(feature::EImageDescriberType::UNKNOWN));
+    chunk.append("\",\n            \"color\": [\n");
+    const uint64_t rgb[3] = {color.r(), color.g(), color.b()};
+    for (int i = 0; i < 3; ++i) {
+        chunk.append("                ");
+        appendIndex(chunk, rgb[i]);
+        chunk.append(i < 2 ? ",\n" : "\n");
+    }
+    chunk.append("            ],\n            \"X\": [\n");
+    for (int i = 0; i < 3; ++i) {
+        chunk.append("                ");
+        appendNumber(chunk, X(i));
+        chunk.append(i < 2 ? ",\n" : "\n");
+    }
+    chunk.append("            ],\n            \"observations\": [");
+    for (size_t i = 0; i < observations.size(); ++i) {
+        chunk.append(i ? ",\n" : "\n");
+        chunk.append("                {\n                    \"observationId\": ");
+        appendIndex(chunk, observations[i].first);
+        if (_with_features) {
+            chunk.append(",\n                    \"featureId\": ");
+            appendIndex(chunk, UndefinedIndexT);
+            chunk.append(",\n                    \"x\": [\n                        ");
+            appendNumber(chunk, observations[i].second(0));
+            chunk.append(",\n                        ");
+            appendNumber(chunk, observations[i].second(1));
+            chunk.append("\n                    ],\n                    \"scale\": \"0\"");
+        }
+        chunk.append("\n                }");
+    }
+    chunk.append("\n            ]\n        }");
+}
+
+bool SfMStreamWriter::writeChunk(const string &chunk) {
+    if (chunk.empty())
+        return true;
+    // every formatted landmark starts with a separator, drop it for the first one
+    size_t offset = _has_landmarks ? 0 : 1;
+    _has_landmarks = true;
+    return write(chunk.data() + offset, chunk.size() - offset);
+}
+
+bool SfMStreamWriter::close() {
+    if (!_file)
+        return false;
+    const char* tail = _has_landmarks ? "\n    ]\n}\n" : "]\n}\n";
+    bool suc = write(tail, strlen(tail)) && flush();
+    suc = (fclose(_file) == 0) && suc;
+    _file = nullptr;
+    return suc;
+}
+
+bool SfMStreamWriter::write(const char *data, size_t size) {
+    if (!_file)
+        return false;
+    if (_buffer.size() + size > _buffer_size && !flush())
+        return false;
+    if (size >= _buffer_size)
+        return fwrite(data, 1, size, _file) == size;
+    _buffer.append(data, size);
+    return true;
+}
+
+bool SfMStreamWriter::flush() {
+    if (_buffer.empty())
+        return true;
+    bool suc = fwrite(_buffer.data(), 1, _buffer.size(), _file) == _buffer.size();
+    _buffer.clear();
+    return suc;
+}
@@ -0,0 +1,60 @@
+#ifndef SFM_WRITER_H
+#define SFM_WRITER_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <aliceVision/sfmData/SfMData.hpp>
+
+using namespace aliceVision;
+
+namespace utils {
+namespace json {
+    // Append an unsigned integer as a JSON string value, e.g. "42"
+    void appendIndex(std::string &out, uint64_t value);
+    // Append a real number with at most 9 fractional digits, without quotes
+    void appendRawNumber(std::string &out, double value);
+    // Append a real number as a JSON string value, e.g. "0.5"
+    void appendNumber(std::string &out, double value);
+};
+};
+
+// Writes the Meshroom .sfm JSON schema with landmarks streamed in chunks,
+// so the structure never has to be held as sfmData::Landmarks in memory
+class SfMStreamWriter {
+public:
+    explicit SfMStreamWriter(const std::string& filepath, size_t buffer_size = 1 << 22);
+    ~SfMStreamWriter();
+
+    inline bool isOpen() const { return _file != nullptr; }
+
+    // Write views, intrinsics and poses of sfm_data and open the structure array
+    bool writeHeader(const sfmData::SfMData& sfm_data);
+
+    // Format one landmark into a chunk, observations are (view id, projected pixel) pairs
+    // sorted by view id. Chunks can be formatted in parallel and are written in order
+    void formatLandmark(std::string& chunk, IndexT landmark_id, const Vec3& X, const image::RGBColor& color,
+                        const std::vector<std::pair<IndexT, Vec2>>& observations) const;
+    bool writeChunk(const std::string& chunk);
+
+    // Close the structure array and the document
+    bool close();
+
+private:
+    bool write(const char* data, size_t size);
+    bool flush();
+
+    FILE* _file = nullptr;
+    std::string _filepath;
+    std::string _buffer;
+    size_t _buffer_size;
+    bool _has_landmarks = false;
+    bool _with_features = true;
+};
+
+
+#endif //SFM_WRITER_H
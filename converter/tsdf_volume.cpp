@@ -0,0 +1,317 @@
+#include "tsdf_volume.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <omp.h>
+
+using namespace std;
+
+namespace {
+    // Marching cubes cases, corner c of a cube is at offset (c & 1, c >> 1 & 1, c >> 2 & 1) and is inside when
+    // bit c of the case is set. The triangles are built once by tracing, on every face of the cube, the
+    // boundary of the inside corners and fan triangulating the loops it forms. Inside corners of a face are
+    // always kept apart, a choice made from the face alone, so that adjacent cubes agree and the mesh is closed.
+    struct CubeTables {
+        int edge_corners[12][2];
+        int edge_axis[12];
+        std::vector<int> triangles[256]; // three edges per triangle
+    };
+
+    CubeTables buildCubeTables() {
+        CubeTables tables;
+        int edge_of[8][8];
+        int e = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int c = 0; c < 8; ++c) {
+                if (c >> axis & 1)
+                    continue;
+                const int d = c | 1 << axis;
+                tables.edge_corners[e][0] = c;
+                tables.edge_corners[e][1] = d;
+                tables.edge_axis[e] = axis;
+                edge_of[c][d] = edge_of[d][c] = e;
+                ++e;
+            }
+        }
+        // face corners counter-clockwise seen from outside the cube
+        int faces[6][4];
+        for (int axis = 0; axis < 3; ++axis) {
+            const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+            for (int side = 0; side < 2; ++side) {
+                int *quad = faces[2 * axis + side];
+                const int base = side << axis;
+                quad[0] = base;
+                quad[1] = base | 1 << u;
+                quad[2] = base | 1 << u | 1 << v;
+                quad[3] = base | 1 << v;
+                if (!side)
+                    std::swap(quad[1], quad[3]);
+            }
+        }
+
+        for (int config = 0; config < 256; ++config) {
+            auto inside = [config](int c) { return (config >> c & 1) != 0; };
+            // every edge entering the inside corners of a face is followed by the first edge leaving them
+            int next[12];
+            std::fill(next, next + 12, -1);
+            for (const int *quad : faces) {
+                for (int k = 0; k < 4; ++k) {
+                    const int a = quad[(k + 3) % 4], b = quad[k];
+                    if (inside(a) || !inside(b))
+                        continue;
+                    for (int m = 1; m <= 4; ++m) {
+                        const int p = quad[(k + m - 1) % 4], q = quad[(k + m) % 4];
+                        if (inside(p) && !inside(q)) {
+                            next[edge_of[a][b]] = edge_of[p][q];
+                            break;
+                        }
+                    }
+                }
+            }
+            bool used[12] = {false};
+            for (int start = 0; start < 12; ++start) {
+                if (next[start] < 0 || used[start])
+                    continue;
+                std::vector<int> loop;
+                for (int edge = start; !used[edge]; edge = next[edge]) {
+                    used[edge] = true;
+                    loop.emplace_back(edge);
+                }
+                for (size_t i = 1; i + 1 < loop.size(); ++i) {
+                    tables.triangles[config].emplace_back(loop[0]);
+                    tables.triangles[config].emplace_back(loop[i]);
+                    tables.triangles[config].emplace_back(loop[i + 1]);
+                }
+            }
+        }
+        return tables;
+    }
+
+    const CubeTables &cubeTables() {
+        static const CubeTables tables = buildCubeTables();
+        return tables;
+    }
+
+    // 21 bits per axis centered on the origin, as the voxels of DepthPointCloud
+    const int64_t half_cell = 1 << 20;
+    const int64_t max_cell = (1 << 21) - 1;
+};
+
+TSDFVolume::TSDFVolume(float voxel_size, float truncation, size_t budget_bytes)
+    : _voxel_size(voxel_size), _truncation(truncation * voxel_size) {
+    // voxels, key and hash entry of a block
+    _max_blocks = budget_bytes / (block_voxels * sizeof(Voxel) + 4 * sizeof(uint64_t));
+}
+
+uint64_t TSDFVolume::blockKey(const Eigen::Vector3i &block) const {
+    uint64_t key = 0;
+    for (int d = 0; d < 3; ++d) {
+        const int64_t c = std::min<int64_t>(std::max<int64_t>((int64_t) block(d) + half_cell, 0), max_cell);
+        key |= (uint64_t) c << (21 * d);
+    }
+    return key;
+}
+
+Eigen::Vector3i TSDFVolume::blockCoord(uint64_t key) const {
+    Eigen::Vector3i block;
+    for (int d = 0; d < 3; ++d)
+        block(d) = (int) ((int64_t) (key >> (21 * d) & max_cell) - half_cell);
+    return block;
+}
+
+const TSDFVolume::Voxel *TSDFVolume::findVoxel(const Eigen::Vector3i &voxel) const {
+    Eigen::Vector3i block, local;
+    for (int d = 0; d < 3; ++d) {
+        block(d) = voxel(d) >= 0 ? voxel(d) / block_size : (voxel(d) - block_size + 1) / block_size;
+        local(d) = voxel(d) - block(d) * block_size;
+    }
+    auto it = _blocks.find(blockKey(block));
+    if (it == _blocks.end())
+        return nullptr;
+    return &_voxels[(size_t) it->second * block_voxels + (local(2) * block_size + local(1)) * block_size + local(0)];
+}
+
+void TSDFVolume::integrate(const float *depth, int width, int height, const Eigen::Matrix3f &K, const Eigen::Matrix4f &pose,
+                           const uint8_t *confidence, uint8_t min_confidence, float max_depth) {
+    const Eigen::Matrix3f K_inv = K.inverse();
+    const Eigen::Matrix3f rotation = pose.block<3, 3>(0, 0);
+    const Eigen::Vector3f translation = pose.block<3, 1>(0, 3);
+    const float block_length = _voxel_size * block_size;
+    auto valid = [&](int i) {
+        return depth[i] > 0.0f && depth[i] <= max_depth && (!confidence || confidence[i] >= min_confidence);
+    };
+
+    // blocks crossed by the truncation band around the observed surface, sampled every half block
+    const int band_samples = (int) ceil(4.0f * _truncation / block_length) + 1;
+    vector<vector<uint64_t>> thread_keys(omp_get_max_threads());
+#pragma omp parallel for schedule(static)
+    for (int v = 0; v < height; ++v) {
+        vector<uint64_t> &keys = thread_keys[omp_get_thread_num()];
+        for (int u = 0; u < width; ++u) {
+            const int i = v * width + u;
+            if (!valid(i))
+                continue;
+            const Eigen::Vector3f ray = K_inv * Eigen::Vector3f(u + 0.5f, v + 0.5f, 1.0f);
+            for (int s = 0; s <= band_samples; ++s) {
+                const float d = depth[i] - _truncation + 2.0f * _truncation * s / band_samples;
+                const Eigen::Vector3f point = rotation * (ray * d) + translation;
+                keys.emplace_back(blockKey((point / block_length).array().floor().cast<int>()));
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+
+    // allocation is serial, the hash is only read while the voxels are updated
+    vector<uint64_t> keys;
+    for (const vector<uint64_t> &thread : thread_keys)
+        keys.insert(keys.end(), thread.begin(), thread.end());
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    vector<int> frame_blocks;
+    frame_blocks.reserve(keys.size());
+    for (uint64_t key : keys) {
+        auto it = _blocks.find(key);
+        if (it != _blocks.end()) {
+            frame_blocks.emplace_back(it->second);
+            continue;
+        }
+        if (_block_keys.size() >= _max_blocks) {
+            ++_dropped_blocks;
+            continue;
+        }
+        // grow the voxels geometrically, but never beyond the budget
+        const size_t needed = (_block_keys.size() + 1) * block_voxels;
+        if (needed > _voxels.capacity())
+            _voxels.reserve(std::min(_max_blocks * block_voxels, std::max(needed, 2 * _voxels.capacity())));
+        _voxels.resize(needed);
+        _blocks.emplace(key, (int) _block_keys.size());
+        frame_blocks.emplace_back(_block_keys.size());
+        _block_keys.emplace_back(key);
+    }
+
+    // every block is updated by a single thread
+    const Eigen::Matrix3f rotation_inv = rotation.transpose();
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < (int) frame_blocks.size(); ++b) {
+        const int block = frame_blocks[b];
+        const Eigen::Vector3i origin = blockCoord(_block_keys[block]) * block_size;
+        Voxel *voxels = &_voxels[(size_t) block * block_voxels];
+        for (int z = 0; z < block_size; ++z) {
+            for (int y = 0; y < block_size; ++y) {
+                for (int x = 0; x < block_size; ++x) {
+                    const Eigen::Vector3f center = ((origin + Eigen::Vector3i(x, y, z)).cast<float>().array() + 0.5f) * _voxel_size;
+                    const Eigen::Vector3f point = rotation_inv * (center - translation);
+                    if (point(2) <= 0.0f)
+                        continue;
+                    const Eigen::Vector3f pixel = K * point;
+                    const int u = (int) floor(pixel(0) / pixel(2));
+                    const int v = (int) floor(pixel(1) / pixel(2));
+                    if (u < 0 || u >= width || v < 0 || v >= height)
+                        continue;
+                    const int i = v * width + u;
+                    if (!valid(i))
+                        continue;
+                    // projective distance along the camera axis, truncated in front of the surface
+                    const float sdf = depth[i] - point(2);
+                    if (sdf < -_truncation)
+                        continue;
+                    const float tsdf = std::min(sdf / _truncation, 1.0f);
+                    // ARKit confidence levels 0, 1 and 2 weigh a third, two thirds and all of a sample
+                    const float weight = confidence ? (confidence[i] + 1) / 3.0f : 1.0f;
+                    Voxel &voxel = voxels[(z * block_size + y) * block_size + x];
+                    voxel.tsdf = (voxel.tsdf * voxel.weight + tsdf * weight) / (voxel.weight + weight);
+                    voxel.weight += weight;
+                }
+            }
+        }
+    }
+}
+
+void TSDFVolume::extractMesh(MatrixXu &faces, MatrixXf &positions) const {
+    const CubeTables &tables = cubeTables();
+    const int num_blocks = _block_keys.size();
+
+    // vertices are keyed by the voxel at the start of their edge and the edge axis, 20 bits per axis
+    auto edgeKey = [](const Eigen::Vector3i &voxel, int axis) {
+        uint64_t key = axis;
+        for (int d = 0; d < 3; ++d)
+            key |= (uint64_t) ((voxel(d) + (1 << 19)) & ((1 << 20) - 1)) << (2 + 20 * d);
+        return key;
+    };
+    typedef std::pair<uint64_t, Eigen::Vector3f> Vertex;
+    // triangles are kept per block and concatenated in block order, whichever thread extracted them
+    vector<vector<Vertex>> thread_vertices(omp_get_max_threads());
+    vector<vector<uint64_t>> block_triangles(num_blocks);
+#pragma omp parallel for schedule(dynamic)
+    for (int block = 0; block < num_blocks; ++block) {
+        vector<Vertex> &vertices = thread_vertices[omp_get_thread_num()];
+        vector<uint64_t> &triangles = block_triangles[block];
+        const Eigen::Vector3i origin = blockCoord(_block_keys[block]) * block_size;
+        const Voxel *voxels = &_voxels[(size_t) block * block_voxels];
+        for (int z = 0; z < block_size; ++z) {
+            for (int y = 0; y < block_size; ++y) {
+                for (int x = 0; x < block_size; ++x) {
+                    // corners of the cube starting at this voxel, from the neighbor blocks on the border
+                    const Voxel *corners[8];
+                    const bool interior = x + 1 < block_size && y + 1 < block_size && z + 1 < block_size;
+                    bool observed = true;
+                    int config = 0;
+                    for (int c = 0; c < 8 && observed; ++c) {
+                        const int cx = x + (c & 1), cy = y + (c >> 1 & 1), cz = z + (c >> 2 & 1);
+                        corners[c] = interior ? &voxels[(cz * block_size + cy) * block_size + cx]
+                                              : findVoxel(origin + Eigen::Vector3i(cx, cy, cz));
+                        observed = corners[c] && corners[c]->weight > 0.0f;
+                        if (observed && corners[c]->tsdf < 0.0f)
+                            config |= 1 << c;
+                    }
+                    if (!observed || !config || config == 255)
+                        continue;
+
+                    const Eigen::Vector3i voxel = origin + Eigen::Vector3i(x, y, z);
+                    for (int e : tables.triangles[config]) {
+                        const int a = tables.edge_corners[e][0];
+                        const int axis = tables.edge_axis[e];
+                        const Eigen::Vector3i start = voxel + Eigen::Vector3i(a & 1, a >> 1 & 1, a >> 2 & 1);
+                        const uint64_t key = edgeKey(start, axis);
+                        triangles.emplace_back(key);
+                        // zero crossing interpolated along the edge
+                        const float fa = corners[a]->tsdf;
+                        const float fb = corners[tables.edge_corners[e][1]]->tsdf;
+                        Eigen::Vector3f point = start.cast<float>().array() + 0.5f;
+                        point(axis) += fa / (fa - fb);
+                        vertices.emplace_back(key, point * _voxel_size);
+                    }
+                }
+            }
+        }
+    }
+
+    // shared vertices in key order, so that the mesh does not depend on the thread schedule
+    vector<Vertex> vertices;
+    size_t num_indices = 0;
+    for (size_t t = 0; t < thread_vertices.size(); ++t) {
+        vertices.insert(vertices.end(), thread_vertices[t].begin(), thread_vertices[t].end());
+        vector<Vertex>().swap(thread_vertices[t]);
+    }
+    for (const vector<uint64_t> &triangles : block_triangles)
+        num_indices += triangles.size();
+    auto key_less = [](const Vertex &a, const Vertex &b) { return a.first < b.first; };
+    tbb::parallel_sort(vertices.begin(), vertices.end(), key_less);
+    vertices.erase(std::unique(vertices.begin(), vertices.end(),
+                               [](const Vertex &a, const Vertex &b) { return a.first == b.first; }), vertices.end());
+
+    positions.resize(3, vertices.size());
+    for (size_t v = 0; v < vertices.size(); ++v)
+        positions.col(v) = vertices[v].second;
+    faces.resize(3, num_indices / 3);
+    size_t index = 0;
+    for (const vector<uint64_t> &triangles : block_triangles) {
+        for (uint64_t key : triangles) {
+            const auto it = std::lower_bound(vertices.begin(), vertices.end(), Vertex(key, Eigen::Vector3f()), key_less);
+            faces(index % 3, index / 3) = (uint32_t) (it - vertices.begin());
+            ++index;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef TSDF_VOLUME_H
+#define TSDF_VOLUME_H
+
+#define EIGEN_MAX_ALIGN_BYTES 0
+#define EIGEN_MAX_STATIC_ALIGN_BYTES 0
+
+#include <unordered_map>
+#include <vector>
+
+#include "utils.h"
+#include <common.h>
+
+// Truncated signed distance volume fused from depth frames with known poses. Voxels are allocated in sparse
+// blocks of 8^3 around the observed surfaces only, found through a hash of the block coordinates, up to a
+// memory budget. The surface is extracted with marching cubes.
+class TSDFVolume {
+public:
+    // truncation in voxels, blocks beyond budget_bytes are not allocated
+    TSDFVolume(float voxel_size, float truncation = 4.0f, size_t budget_bytes = (size_t) 1 << 30);
+
+    // Fuse a depth frame with intrinsics K at its resolution and the camera pose (camera to world).
+    // Pixels beyond max_depth or below min_confidence are skipped, the others are weighted by their ARKit
+    // confidence. The blocks of a frame are updated in parallel.
+    void integrate(const float *depth, int width, int height, const Eigen::Matrix3f &K, const Eigen::Matrix4f &pose,
+                   const uint8_t *confidence = nullptr, uint8_t min_confidence = 0, float max_depth = 4.0f);
+
+    // Zero crossing of the fused distances as a triangle mesh, vertices shared between adjacent cubes
+    void extractMesh(MatrixXu &faces, MatrixXf &positions) const;
+
+    inline size_t getBlockNum() const { return _block_keys.size(); }
+    inline size_t getDroppedBlockNum() const { return _dropped_blocks; }
+    inline size_t getMemory() const { return _voxels.size() * sizeof(Voxel); }
+
+private:
+    static const int block_size = 8;
+    static const int block_voxels = block_size * block_size * block_size;
+    struct Voxel {
+        float tsdf = 1.0f;
+        float weight = 0.0f;
+    };
+
+    uint64_t blockKey(const Eigen::Vector3i &block) const;
+    Eigen::Vector3i blockCoord(uint64_t key) const;
+    // voxel at global voxel coordinates, nullptr if its block is not allocated
+    const Voxel *findVoxel(const Eigen::Vector3i &voxel) const;
+
+    float _voxel_size;
+    float _truncation;
+    size_t _max_blocks;
+    size_t _dropped_blocks = 0;
+
+    std::unordered_map<uint64_t, int> _blocks; // block key to block index
+    std::vector<uint64_t> _block_keys;
+    std::vector<Voxel> _voxels; // block_voxels per block, x fastest
+};
+
+
+#endif //TSDF_VOLUME_H
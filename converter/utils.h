@@ -1,11 +1,15 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <experimental/filesystem>
 
+#include <sys/resource.h>
+
 #include <Eigen/Dense>
 typedef const Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> ConstRowMatrixX3f;
 typedef Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> RowMatrixX3f;
@@ -13,6 +17,13 @@ typedef Eigen::Matrix<float, Eigen::Dynamic, 9, Eigen::RowMajor> RowMatrixX9f;
 typedef Eigen::Matrix<float, Eigen::Dynamic, 16, Eigen::RowMajor> RowMatrixX16f;
 
 namespace utils {
+    // Peak resident set size of the process in bytes
+    inline size_t getPeakMemory() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (size_t) usage.ru_maxrss * 1024;
+    }
+
 namespace io{
     namespace fs = std::experimental::filesystem;
 
@@ -40,6 +51,29 @@ namespace io{
             return path.stem().string();
     }
 
+    // Path of another file of the same ARKit scan, e.g. <scanID>.json next to <scanID>.jsonl
+    inline std::string getScanFilePath(const std::string &traj_path, const std::string &ext) {
+        return fs::path(traj_path).replace_extension(ext).string();
+    }
+
+    // Whole file into data, reusing its capacity; false if the file cannot be read
+    inline bool readFile(const std::string &file_path, std::vector<uint8_t> &data) {
+        std::ifstream file(file_path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        data.resize((size_t) file.tellg());
+        file.seekg(0);
+        return (bool) file.read(reinterpret_cast<char *>(data.data()), data.size());
+    }
+
+    // Create the folder if it does not exist yet, keeping its content otherwise
+    inline bool makeFolder(const std::string &dir_path) {
+        fs::path abs_dir = fs::absolute(dir_path);
+        if (pathExists(abs_dir))
+            return fs::is_directory(abs_dir);
+        return pathExists(abs_dir.parent_path()) && fs::create_directory(abs_dir);
+    }
+
     inline bool makeCleanFolder(const std::string &dir_path) {
         fs::path abs_dir = fs::absolute(dir_path);
         bool suc = false;
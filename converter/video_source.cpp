@@ -0,0 +1,114 @@
+#include "video_source.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "color_kernels.h"
+
+using namespace std;
+
+namespace {
+    // gaps longer than this are seeked rather than decoded through, about the keyframe interval of ARKit videos
+    const size_t seek_gap = 60;
+    // a frame less sharp than this fraction of the sharpest frame of its step window is replaced
+    const float blur_ratio = 0.75f;
+};
+
+VideoFrameSource::VideoFrameSource(const string &filepath, const FrameSampling &sampling, bool select_sharp)
+    : _filepath(filepath), _sampling(sampling), _select_sharp(select_sharp) {
+    _capture.open(filepath, cv::CAP_FFMPEG);
+    if (!_capture.isOpened())
+        cerr << "Unable to open the video " << filepath << endl;
+}
+
+bool VideoFrameSource::seek(size_t frame_idx) {
+    if (frame_idx < _next_frame) {
+        cerr << "Frame " << frame_idx << " requested after frame " << _next_frame
+             << ", the video is only read forward" << endl;
+        return false;
+    }
+    if (frame_idx - _next_frame > seek_gap) {
+        if (!_capture.set(cv::CAP_PROP_POS_FRAMES, (double) frame_idx))
+            return false;
+    }
+    else {
+        for (; _next_frame < frame_idx; ++_next_frame) {
+            if (!_capture.grab())
+                return false;
+        }
+    }
+    _next_frame = frame_idx;
+    return true;
+}
+
+bool VideoFrameSource::read(int cam_idx, cv::Mat &frame) {
+    if (_select_sharp)
+        return readSharpest(cam_idx, frame);
+    if (!seek(_sampling.frameIndex(cam_idx)))
+        return false;
+    ++_next_frame;
+    return _capture.read(frame) && !frame.empty();
+}
+
+bool VideoFrameSource::readSharpest(int cam_idx, cv::Mat &frame) {
+    // the window of step frames centered on the step-th frame, so that the cameras stay evenly spaced
+    const size_t center = _sampling.frameIndex(cam_idx);
+    const size_t half = _sampling.step / 2;
+    const size_t begin = center > half ? center - half : 0;
+    const size_t end = center - half + _sampling.step;
+    if (!seek(begin))
+        return false;
+
+    // the decoded frames are swapped into the buffers of the center and of the sharpest other frame, never copied
+    float center_sharpness = -1.0f, sharpest_sharpness = -1.0f;
+    size_t sharpest = center;
+    for (size_t f = begin; f < end; ++f) {
+        // a window past the end of the video keeps the frames decoded so far
+        if (!_capture.read(_decoded) || _decoded.empty())
+            break;
+        ++_next_frame;
+        const float sharpness = measureSharpness(_decoded);
+        if (f == center) {
+            center_sharpness = sharpness;
+            std::swap(_decoded, _center);
+        }
+        else if (sharpness > sharpest_sharpness) {
+            sharpest_sharpness = sharpness;
+            sharpest = f;
+            std::swap(_decoded, _sharpest);
+        }
+    }
+    if (center_sharpness < 0.0f && sharpest_sharpness < 0.0f)
+        return false;
+
+    // the frame given back to the caller becomes a buffer of the next window
+    size_t selected = center;
+    if (center_sharpness < blur_ratio * sharpest_sharpness) {
+        selected = sharpest;
+        std::swap(frame, _sharpest);
+    }
+    else
+        std::swap(frame, _center);
+    if (_selected.size() <= (size_t) cam_idx)
+        _selected.resize(cam_idx + 1, -1);
+    _selected[cam_idx] = (int) selected;
+    return true;
+}
+
+float VideoFrameSource::measureSharpness(const cv::Mat &frame) {
+    // luma at a quarter of the resolution: motion blur spans several pixels, sensor noise is averaged out
+    cv::cvtColor(frame, _luma, cv::COLOR_BGR2GRAY);
+    cv::resize(_luma, _low, cv::Size(_luma.cols / 4, _luma.rows / 4), 0, 0, cv::INTER_AREA);
+    return utils::color::laplacianVariance(_low.ptr<uint8_t>(), _low.cols, _low.rows, _low.step);
+}
+
+size_t VideoFrameSource::frameIndex(int cam_idx) const {
+    if ((size_t) cam_idx < _selected.size() && _selected[cam_idx] >= 0)
+        return (size_t) _selected[cam_idx];
+    return _sampling.frameIndex(cam_idx);
+}
+
+void VideoFrameSource::hashFrame(int cam_idx, FrameHash &hash) const {
+    // the whole video stands for each of its frames
+    hash.addFile(_filepath).add((uint64_t) frameIndex(cam_idx));
+}
@@ -0,0 +1,46 @@
+#ifndef VIDEO_SOURCE_H
+#define VIDEO_SOURCE_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "frame_manifest.h"
+#include "frame_sampling.h"
+
+// Color frames of the sampled cameras decoded from the ARKit <scanID>.mp4, one frame of the trajectory per video
+// frame. Only the frames of the sampled cameras are converted to images: short gaps are skipped by demuxing and
+// decoding without conversion, longer ones by seeking to the keyframe before the next frame. The FFmpeg backend of
+// OpenCV decodes with one thread per core.
+// With sharp frame selection, every frame of the step window centered on the step-th frame of a camera is decoded
+// and measured while the camera is read, and the sharpest one replaces the step-th frame when that is blurry.
+class VideoFrameSource {
+public:
+    VideoFrameSource(const std::string& filepath, const FrameSampling& sampling, bool select_sharp = false);
+
+    inline bool isOpen() const { return _capture.isOpened(); }
+    // Decode the 8-bit BGR frame of camera cam_idx; cameras are read in increasing order, one at a time
+    bool read(int cam_idx, cv::Mat& frame);
+    // Video frame of camera cam_idx, the selected one once the camera is read
+    size_t frameIndex(int cam_idx) const;
+    void hashFrame(int cam_idx, FrameHash& hash) const;
+
+private:
+    // Position the video so that the next decoded frame is frame_idx
+    bool seek(size_t frame_idx);
+    bool readSharpest(int cam_idx, cv::Mat& frame);
+    float measureSharpness(const cv::Mat& frame);
+
+    std::string _filepath;
+    cv::VideoCapture _capture;
+    FrameSampling _sampling;
+    bool _select_sharp = false;
+    size_t _next_frame = 0;
+    std::vector<int> _selected; // per camera read, -1 for the others
+    // buffers of the frames decoded in a window, reused from camera to camera
+    cv::Mat _decoded, _center, _sharpest, _luma, _low;
+};
+
+
+#endif //VIDEO_SOURCE_H
@@ -0,0 +1,72 @@
+#include "zlib_stream.h"
+
+#include <iostream>
+
+using namespace std;
+
+ZlibFrameReader::ZlibFrameReader(const string &filepath, size_t frame_bytes, size_t chunk_bytes)
+    : _frame_bytes(frame_bytes), _in(chunk_bytes) {
+    memset(&_stream, 0, sizeof(_stream));
+    if (inflateInit(&_stream) != Z_OK) {
+        cerr << "Unable to initialize zlib for " << filepath << endl;
+        return;
+    }
+    _file = fopen(filepath.c_str(), "rb");
+    if (!_file) {
+        cerr << "Unable to open " << filepath << "!" << endl;
+        inflateEnd(&_stream);
+    }
+}
+
+ZlibFrameReader::~ZlibFrameReader() {
+    if (_file) {
+        fclose(_file);
+        inflateEnd(&_stream);
+    }
+}
+
+bool ZlibFrameReader::inflateTo(unsigned char *dst, size_t bytes) {
+    if (!_file || _failed)
+        return false;
+    _stream.next_out = dst;
+    _stream.avail_out = bytes;
+    while (_stream.avail_out) {
+        if (!_stream.avail_in) {
+            _stream.next_in = _in.data();
+            _stream.avail_in = fread(_in.data(), 1, _in.size(), _file);
+            if (!_stream.avail_in)
+                return false;
+        }
+        const int ret = inflate(&_stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // another stream may follow, e.g. when frames are compressed one by one
+            if (inflateReset(&_stream) != Z_OK) {
+                _failed = true;
+                return false;
+            }
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            cerr << "Corrupted zlib stream at frame " << _frame_index << ": "
+                 << (_stream.msg ? _stream.msg : "unknown error") << endl;
+            _failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ZlibFrameReader::read(void *dst) {
+    if (!inflateTo(static_cast<unsigned char *>(dst), _frame_bytes))
+        return false;
+    ++_frame_index;
+    return true;
+}
+
+bool ZlibFrameReader::skip(size_t count) {
+    _scratch.resize(_frame_bytes);
+    for (size_t i = 0; i < count; ++i) {
+        if (!read(_scratch.data()))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef ZLIB_STREAM_H
+#define ZLIB_STREAM_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace utils {
+    // IEEE 754 half to single precision
+    inline float halfToFloat(uint16_t h) {
+        const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1F;
+        uint32_t mantissa = h & 0x3FF;
+        uint32_t bits;
+        if (exponent == 0x1F) {
+            // inf and nan
+            bits = sign | 0x7F800000 | (mantissa << 13);
+        }
+        else if (exponent) {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        else if (mantissa) {
+            // subnormal half, normalize the mantissa
+            exponent = 113;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+        else {
+            bits = sign;
+        }
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+};
+
+// Sequential reader of fixed-size frames from a zlib compressed ARKit stream such as <scanID>.depth.zlib.
+// The file is inflated in chunks, only one frame and one input chunk are held in memory.
+// Concatenated zlib streams, e.g. one per frame, are read as one.
+class ZlibFrameReader {
+public:
+    ZlibFrameReader(const std::string& filepath, size_t frame_bytes, size_t chunk_bytes = 1 << 20);
+    ~ZlibFrameReader();
+    ZlibFrameReader(const ZlibFrameReader&) = delete;
+    ZlibFrameReader& operator=(const ZlibFrameReader&) = delete;
+
+    inline bool isOpen() const { return _file != nullptr; }
+    // Index of the next frame
+    inline size_t getFrameIndex() const { return _frame_index; }
+
+    // Inflate the next frame into dst of frame_bytes, false at the end of the stream or on error
+    bool read(void *dst);
+    // Inflate and drop the next count frames
+    bool skip(size_t count);
+
+private:
+    bool inflateTo(unsigned char *dst, size_t bytes);
+
+    FILE *_file = nullptr;
+    z_stream _stream;
+    size_t _frame_bytes;
+    std::vector<unsigned char> _in;
+    std::vector<unsigned char> _scratch;
+    size_t _frame_index = 0;
+    bool _failed = false;
+};
+
+
+#endif //ZLIB_STREAM_H